@@ -34,18 +34,33 @@ int TLB_Probe(u_int32_t entryhi, u_int32_t entrylo);
 
 // Added by tocurtis
 int TLB_Insert(vaddr_t faultaddress, paddr_t paddr);
+int TLB_Update(vaddr_t faultaddress, paddr_t paddr);
+void TLB_SetEntryHi(u_int32_t entryhi);
+struct addrspace;
+void TLB_Activate(struct addrspace *as);
+
+/*
+ * Page directory of the current address space, NULL if there is none. The 
+ * UTLB miss handler in exception.S walks it to refill the TLB without 
+ * calling vm_fault() (see REFILL in vm.h). Set by TLB_Activate().
+ */
+extern u_int32_t **tlb_refill_pgdir;
 int TLB_Invalidate_all();
 int TLB_Invalidate(paddr_t paddr);
+int TLB_Invalidate_as(struct addrspace *as);
 void TLB_Init();
 
 
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
- * bits that aren't assigned a meaning.
+ * Note that the MIPS has support for a 6-bit address space ID. We tag 
+ * the entries of each address space with its ASID (TLBHI_PID), so the
+ * TLB doesn't have to be flushed on a context switch. The ASID in the
+ * entryhi register is the one the processor matches against, so it 
+ * must be put back after TLB_Read, TLB_Write or TLB_Probe load another
+ * value into it. TLBLO_GLOBAL can be left always zero, as can the bits
+ * that aren't assigned a meaning.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
  * ever set by the processor. If you set it, writes are permitted. If
@@ -57,7 +72,8 @@ void TLB_Init();
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
@@ -80,6 +96,12 @@ void TLB_Init();
 
 #define NUM_TLB  64
 
+/*
+ * Number of hardware address space IDs. ASID 0 is never given to an
+ * address space.
+ */
+#define NUM_ASID 64
+
 u_int32_t tlb_age[NUM_TLB]; // Will keep track of time
 
 #endif /* _MACHINE_TLB_H_ */
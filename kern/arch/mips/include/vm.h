@@ -76,7 +76,13 @@ void ram_getsize(paddr_t *lo, paddr_t *hi);
 #define EM_MACHINE  EM_MIPS
 
 //added by rahmanmd
-/*Under our VM, we have 48K user stack*/
+/*
+ * Under our VM, the user stack grows on demand below USERSTACK up to 48K 
+ * (VM_STACKPAGES). The VM_STACKGUARD pages below the stack limit are never 
+ * mapped, so the stack and the heap can't run into each other.
+ */
 #define VM_STACKPAGES    12
+#define VM_STACKGUARD    1
+#define VM_STACKLIMIT    (USERSTACK - VM_STACKPAGES*PAGE_SIZE)
 
 #endif /* _MIPS_VM_H_ */
@@ -26,8 +26,6 @@
 //do nothing
 #else
 
-static int last_claimed_index;
-
 //static
 paddr_t
 getppages(unsigned long npages)
@@ -54,7 +52,7 @@ alloc_kpages(int npages)
 	{
 		//Use our vm
 		//		pa = getnpages(npages);
-		pa=kpage_nalloc(npages,curthread->pid);
+		pa=kpage_nalloc(npages);
 	}
 	else
 	{
@@ -75,48 +73,20 @@ alloc_kpages(int npages)
 		vaddr = PADDR_TO_KVADDR(pa);
 	}
 
-	/*update the claimed frames holder*/
-	if(npages>1)
-	{		
-		claimed_frames[last_claimed_index].vaddr=vaddr;
-		claimed_frames[last_claimed_index].npages=npages;
-		last_claimed_index++;	        
-	}
-	
 	return vaddr;
 }
 
 void 
 free_kpages(vaddr_t addr)
 {
-    	int i;
-	int index = 0;
-		
-	/*search for the frame*/
-	for(i=0;i<last_claimed_index;i++)
+	/*
+	 * The number of pages is kept in the coremap with the block, see 
+	 * kpage_free(). The pages stolen before our vm was enabled are never 
+	 * freed.
+	 */
+	if(mips_vm_enabled)
 	{
-		if(claimed_frames[i].vaddr==addr)
-		{
-			index=i;
-			break;
-		}
-	}
-
-	if(index!=0)
-	{	
-		/*remove the physical pages*/
-		for(i=0;i < (int)claimed_frames[index].npages; i++){	
-			remove_ppage( (addr+(i*PAGE_SIZE))-MIPS_KSEG0);		
-		}	
-
-		/*clear the claimed frame slot in the holder*/
-		claimed_frames[index].npages=0;
-		claimed_frames[index].vaddr=0;
-
-		/*update the holder to make the frames started from last_claimed_index as free*/
-		for(i=index;i < (int)last_claimed_index;i++) {
-			claimed_frames[index]=claimed_frames[index+1];
-		}
+		kpage_free(addr - MIPS_KSEG0);
 	}
 }
 
@@ -150,8 +120,21 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-		panic("vm: got VM_FAULT_READONLY\n");
+		/* 
+		 * A write to a clean page, which is mapped read-only. Mark
+		 * it dirty and rewrite its TLB entry with write enabled.
+		 */
+		if (curthread->t_vmspace != NULL)
+			curthread->t_vmspace->as_fault_error = 0;
+		paddr = mark_page_dirty(faultaddress);
+		if (paddr == 0)
+			return (curthread->t_vmspace != NULL && 
+				curthread->t_vmspace->as_fault_error) ?
+				curthread->t_vmspace->as_fault_error : EFAULT;
+		spl = splhigh();
+		TLB_Update(faultaddress, paddr);
+		splx(spl);
+		return 0;
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -193,15 +176,18 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	if(faultaddress <= MIPS_KSEG0)
 	{
 		
-		paddr = handle_page_fault(faultaddress);
-		// Verify we found a paddr
+		as->as_fault_error = 0;
+		paddr = handle_page_fault(faultaddress, faulttype == VM_FAULT_WRITE);
+		// The address is not mapped in this address space, or there
+		// was no memory and swap left for the page
 		if (paddr == 0)
-			panic("Can't find the faultaddress on the core map!\n");
+			return as->as_fault_error ? as->as_fault_error : EFAULT;
 
 		/* make sure it's page-aligned */
 		//DEBUG(DB_VM, "Before assert: paddr == 0x%x\n", paddr);
 
-		paddr = paddr & PAGE_FRAME;
+		//keep the write enable (dirty) bit of the page
+		paddr = paddr & (PAGE_FRAME | TLBLO_DIRTY);
 		//DEBUG(DB_VM, "with page_frame == 0x%x\n", (paddr & PAGE_FRAME));
 		//assert((paddr & PAGE_FRAME)==paddr);
 
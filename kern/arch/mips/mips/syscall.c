@@ -59,6 +59,7 @@ mips_syscall(struct trapframe *tf)
 	time_t seconds; // Used in the gettime function
 	u_int32_t nanoseconds; // Used in the gettime function
 	int *timePtr;
+	int32_t mmap_args[2]; // fd and offset of mmap
 
 	assert(curspl==0);
 
@@ -150,6 +151,30 @@ mips_syscall(struct trapframe *tf)
 			err = sys_dup2(tf->tf_a0, tf->tf_a1, &retval);
 			break;
 
+		case SYS_mmap:
+			// mmap has 6 arguments, the last two are passed on the
+			// user stack past the 16 bytes kept for a0-a3
+			err = copyin((const_userptr_t)(tf->tf_sp + 16), mmap_args, 
+				     sizeof(mmap_args));
+			if (err)
+				break;
+			err = sys_mmap((void *)tf->tf_a0, tf->tf_a1, tf->tf_a2, 
+				       tf->tf_a3, mmap_args[0], mmap_args[1], &retval);
+			//int sys_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset, int *retval)
+			break;
+
+		case SYS_munmap:
+			err = sys_munmap((void *)tf->tf_a0, tf->tf_a1, &retval);
+			break;
+
+		case SYS_msync:
+			err = sys_msync((void *)tf->tf_a0, tf->tf_a1, tf->tf_a2, &retval);
+			break;
+
+		case SYS_vmstat:
+			err = sys_vmstat((struct vmstat *)tf->tf_a0, &retval);
+			break;
+
 		//added by rahmanmd
 	    case SYS_fork:
 	        ///kprintf("\nEntering sys_fork()\n");
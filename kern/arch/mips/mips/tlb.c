@@ -18,6 +18,49 @@
 #define NRU 1 // Not recently used
 #define TLB_REPLACEMENT_ALGO RND
 
+/*entryhi of the current address space (ASID field only)*/
+static u_int32_t cur_entryhi = 0;
+/*page directory walked by the UTLB miss handler, see tlb.h*/
+u_int32_t **tlb_refill_pgdir = NULL;
+
+#if !OPT_DUMBVM
+/*
+ * ASID allocation. ASIDs are handed out in order within a generation. An 
+ * address space keeps its ASID as long as its generation is the current 
+ * one. When the ASIDs run out a new generation starts and the whole TLB is 
+ * flushed, as the entries tagged with the old ASIDs may belong to any 
+ * address space. Generation 0 is never current, so a new address space 
+ * gets an ASID on its first activation.
+ */
+static u_int32_t asid_generation = 1;
+static u_int32_t asid_next = 1;
+
+/*
+ * Make as the address space seen by the processor, giving it a new ASID if 
+ * its ASID is from an older generation.
+ */
+void TLB_Activate(struct addrspace *as)
+{
+	int spl;
+	
+	spl = splhigh();
+	if (as->as_asid_gen != asid_generation) {
+		if (asid_next == NUM_ASID) {
+			/* out of ASIDs, start a new generation */
+			asid_generation++;
+			asid_next = 1;
+			TLB_Invalidate_all();
+		}
+		as->as_asid = asid_next++;
+		as->as_asid_gen = asid_generation;
+	}
+	cur_entryhi = (as->as_asid << TLBHI_PIDSHIFT) & TLBHI_PID;
+	TLB_SetEntryHi(cur_entryhi);
+	tlb_refill_pgdir = as->as_pgdir;
+	splx(spl);
+}
+#endif /* !OPT_DUMBVM */
+
 void TLB_Init()
 {
 	if (TLB_REPLACEMENT_ALGO == RND)
@@ -43,10 +86,11 @@ int TLB_Insert(vaddr_t faultaddress, paddr_t paddr)
 		if (elo & TLBLO_VALID) {
 			continue;
 		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+		ehi = faultaddress | cur_entryhi;
+		elo = paddr | TLBLO_VALID;
 		DEBUG(DB_VM, "TLB Added: 0x%x -> 0x%x at location %d\n", faultaddress, paddr, i);
 		TLB_Write(ehi, elo, i);
+		TLB_SetEntryHi(cur_entryhi);
 		//splx(spl); // Leave that to calling function
 		return 0;
 	}
@@ -83,8 +127,8 @@ int TLB_Insert(vaddr_t faultaddress, paddr_t paddr)
 				}
 				
 				// Now put it in a spot not recently used 	
-				ehi = faultaddress;
-				elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+				ehi = faultaddress | cur_entryhi;
+				elo = paddr | TLBLO_VALID;
 				DEBUG(DB_VM, "TLB Added: 0x%x -> 0x%x\n", faultaddress, paddr);
 				DEBUG(DB_VM, "\n\nReplacing entry %d on TLB.\n\n", nru_entry);
 				TLB_Write(ehi, elo, nru_entry);
@@ -95,17 +139,36 @@ int TLB_Insert(vaddr_t faultaddress, paddr_t paddr)
             //By default rnd is used
             default:
 			{
-                ehi = faultaddress;
-				elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+                ehi = faultaddress | cur_entryhi;
+				elo = paddr | TLBLO_VALID;
 				DEBUG(DB_VM, "vm randomly added to slot.\n");
 				TLB_Random(ehi, elo);
 			}
         }                        	
+	TLB_SetEntryHi(cur_entryhi);
 	
 	return 0;
 
 }
 
+/*
+ * Rewrite the entry of faultaddress in place if it is in the TLB, otherwise
+ * insert it. Used when the write permission of a resident page changes, as
+ * the TLB must never hold two entries for the same virtual page.
+ */
+int TLB_Update(vaddr_t faultaddress, paddr_t paddr)
+{
+	int i;
+	
+	i = TLB_Probe(faultaddress | cur_entryhi, 0);
+	if (i < 0)
+		return TLB_Insert(faultaddress, paddr);
+	
+	TLB_Write(faultaddress | cur_entryhi, paddr | TLBLO_VALID, i);
+	TLB_SetEntryHi(cur_entryhi);
+	return 0;
+}
+
 int TLB_Invalidate_all()
 {
 	// Code to invalidate here
@@ -123,6 +186,7 @@ int TLB_Invalidate_all()
 	if (TLB_REPLACEMENT_ALGO == NRU)
 		for (i=0; i<NUM_TLB; i++)
 			tlb_age[i] = 0;
+	TLB_SetEntryHi(cur_entryhi);
 	splx(spl);
 
 	/*
@@ -146,17 +210,52 @@ int TLB_Invalidate_all()
 	return 0;
 }
 
+#if !OPT_DUMBVM
+/*
+ * Invalidate the entries of the address space as, which is going away. Its 
+ * ASID can only be in the TLB if it is from the current generation, and it 
+ * is never handed out again within this generation.
+ */
+int TLB_Invalidate_as(struct addrspace *as)
+{
+	u_int32_t ehi, elo, i, asid;
+	int spl;
+	
+	spl = splhigh();
+	if (as->as_asid_gen == asid_generation) {
+		asid = (as->as_asid << TLBHI_PIDSHIFT) & TLBHI_PID;
+		for (i=0; i<NUM_TLB; i++) {
+			TLB_Read(&ehi, &elo, i);
+			if ((elo & TLBLO_VALID) && (ehi & TLBHI_PID) == asid) {
+				TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			}
+		}
+		TLB_SetEntryHi(cur_entryhi);
+		as->as_asid_gen = 0;
+	}
+	splx(spl);
+	
+	return 0;
+}
+#endif /* !OPT_DUMBVM */
+
+/*
+ * Invalidate the entries mapping the frame paddr, whatever address space 
+ * (ASID) they belong to.
+ */
 int TLB_Invalidate(paddr_t paddr)
 {
     u_int32_t ehi,elo,i;
     for (i=0; i<NUM_TLB; i++) 
     {
         TLB_Read(&ehi, &elo, i);
-        if ((elo & 0xfffff000) == (paddr & 0xfffff000))	
+        if ((elo & TLBLO_VALID) && (elo & 0xfffff000) == (paddr & 0xfffff000))	
         {
             TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);		
         }
     }
+    //TLB_Read loaded the ASID of the last entry into entryhi
+    TLB_SetEntryHi(cur_entryhi);
 
     return 0;
 }
@@ -673,6 +673,18 @@ emufs_fsync(struct vnode *v)
 	return 0;
 }
 
+/*
+ * VOP_MMAP. The VM reads and writes back the pages of the mapping with 
+ * VOP_READ and VOP_WRITE, so any file can be mapped.
+ */
+static
+int
+emufs_mmap(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
 /*
  * VOP_TRUNCATE
  */
@@ -853,7 +865,7 @@ static const struct vnode_ops emufs_fileops = {
 	emufs_file_gettype,
 	emufs_tryseek,
 	emufs_fsync,
-	UNIMP,   /* mmap */
+	emufs_mmap,
 	emufs_truncate,
 	NOTDIR,  /* namefile */
 
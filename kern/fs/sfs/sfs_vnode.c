@@ -1417,14 +1417,15 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). The VM reads and writes back the pages of the mapping 
+ * with VOP_READ and VOP_WRITE, so any file can be mapped.
  */
 static
 int
 sfs_mmap(struct vnode *v   /* add stuff as needed */)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 /*
@@ -3,6 +3,7 @@
  */
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/unistd.h>
 #include <lib.h>
 #include <synch.h>
 #include <vnode.h>
@@ -16,6 +17,7 @@ int fdesc_init(struct fdesc *f_desc, struct vnode *vn)
 	
 	strcpy(f_desc->name, "None");
 	f_desc->mode = 0;
+	f_desc->flags = O_RDONLY;
 	f_desc->offset = 0;
 	f_desc->dup_count = 0;
 	f_desc->vn = vn;
@@ -6,6 +6,35 @@
 
 struct vnode;
 
+/*
+ * File backing of a region of the address space. The pages of the region are
+ * read from the executable on their first fault, the part of the region past
+ * rf_filesz (bss) is zero filled. See load_page_from_file() in vm.c.
+ */
+struct region_file {
+	vaddr_t rf_vaddr;	/* start of the segment, not page aligned */
+	off_t rf_offset;	/* offset of the segment in the file */
+	size_t rf_filesz;	/* bytes of the segment present in the file */
+	int rf_shared;		/* read-only text, frames shared via the text cache */
+};
+
+/*
+ * A file mapped with mmap(). The pages of the mapping are read from the file
+ * on their first fault. The dirty pages of a MAP_SHARED mapping are written 
+ * back to the file on msync(), munmap() and eviction, but never past the 
+ * size the file had when it was mapped. See load_page_from_mmap() in vm.c.
+ */
+struct mmap_region {
+	vaddr_t mr_vaddr;	/* start of the mapping, page aligned */
+	size_t mr_npages;
+	struct vnode *mr_file;	/* mapped file (referenced) */
+	off_t mr_offset;	/* offset of mr_vaddr in the file, page aligned */
+	off_t mr_filesz;	/* size of the file when it was mapped */
+	int mr_prot;		/* PROT_* */
+	int mr_flags;		/* MAP_SHARED or MAP_PRIVATE */
+	struct mmap_region *mr_next;
+};
+
 /* 
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -36,6 +65,26 @@ struct addrspace {
         vaddr_t as_heaptop;
         vaddr_t as_heapbase;
         pid_t pid;
+        //two-level page table (page directory), see vm.h
+        u_int32_t **as_pgdir;
+        //executable backing the two regions (referenced), NULL if none
+        struct vnode *as_file;
+        struct region_file as_file1;
+        struct region_file as_file2;
+        //hardware ASID tagging our TLB entries, valid in generation as_asid_gen
+        u_int32_t as_asid;
+        u_int32_t as_asid_gen;
+        //file mappings, placed downwards from as_mmapbase below the stack
+        struct mmap_region *as_mmaps;
+        vaddr_t as_mmapbase;
+        //faults handled for us, see VMSTAT_ADD() in vm.h
+        struct vmcounters as_stats;
+        //frames we own (resident set size), see frame_set_owner() in vm.c
+        u_int32_t as_rss;
+        //virtual time of the WSClock page replacement: our faults so far
+        u_int32_t as_vtime;
+        //ENOMEM if the last fault failed for want of memory and swap
+        int as_fault_error;
 #endif
 };
 
@@ -60,7 +109,8 @@ struct addrspace {
  *                the way this works if implementing user-level threads.
  *
  *    as_define_region - set up a region of memory within the address
- *                space.
+ *                space. Without dumbvm the region is backed by FILESZ bytes
+ *                of the vnode at OFFSET, and paged in on demand.
  *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
@@ -71,6 +121,14 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_mmap - place a mapping of NPAGES pages of the vnode at OFFSET
+ *                below the lowest mapping and hand back its address. 
+ *                Returns ENOMEM if it would run into the heap.
+ *
+ *    as_find_mmap - return the mapping containing VADDR, or NULL.
+ *
+ *    as_remove_mmap - write back and unmap a mapping, and free it.
  */
 
 struct addrspace *as_create(void);
@@ -82,14 +140,31 @@ int               as_copy(struct addrspace *src, struct addrspace **ret, pid_t p
 void              as_activate(struct addrspace *);
 void              as_destroy(struct addrspace *);
 
+#if OPT_DUMBVM
 int               as_define_region(struct addrspace *as, 
 				   vaddr_t vaddr, size_t sz,
 				   int readable, 
 				   int writeable,
 				   int executable);
+#else
+int               as_define_region(struct addrspace *as, 
+				   vaddr_t vaddr, size_t sz,
+				   int readable, 
+				   int writeable,
+				   int executable,
+				   struct vnode *v, off_t offset,
+				   size_t filesz);
+#endif
 int		  as_prepare_load(struct addrspace *as);
 int		  as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if !OPT_DUMBVM
+int               as_define_mmap(struct addrspace *as, size_t npages,
+				 struct vnode *v, off_t offset, off_t filesz,
+				 int prot, int flags, vaddr_t *ret);
+struct mmap_region *as_find_mmap(struct addrspace *as, vaddr_t vaddr);
+int               as_remove_mmap(struct addrspace *as, struct mmap_region *mr);
+#endif
 
 /*
  * Functions in loadelf.c
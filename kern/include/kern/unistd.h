@@ -34,6 +34,20 @@
 #define SEEK_CUR      1      /* Seek relative to current position in file */
 #define SEEK_END      2      /* Seek relative to end of file */
 
+/* Protection of a mapping for mmap */
+#define PROT_NONE     0      /* Page can't be accessed */
+#define PROT_READ     1      /* Page can be read */
+#define PROT_WRITE    2      /* Page can be written */
+#define PROT_EXEC     4      /* Page can be executed */
+
+/* Flags for mmap: choose one of these: */
+#define MAP_SHARED    1      /* Writes go back to the file */
+#define MAP_PRIVATE   2      /* Writes are private to the process */
+
+/* Flags for msync */
+#define MS_ASYNC      1      /* Schedule the writes (done synchronously) */
+#define MS_SYNC       2      /* Write back before returning */
+
 /* The codes for ioctl are in kern/ioctl.h */
 /* The codes for stat/fstat/lstat are in kern/stat.h */
 
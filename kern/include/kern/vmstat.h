@@ -0,0 +1,57 @@
+#ifndef _KERN_VMSTAT_H_
+#define _KERN_VMSTAT_H_
+
+/*
+ * Structures for vmstat (call to get virtual memory statistics)
+ */
+
+/*
+ * Buckets of the fault latency histogram: under 10us, 100us, 1ms, 10ms,
+ * 100ms, and the rest.
+ */
+#define VMSTAT_LAT_BUCKETS 6
+
+/*
+ * Faults handled for one address space, or for all of them since boot.
+ */
+struct vmcounters {
+	u_int32_t vc_tlb_faults;	/* TLB refills of resident pages by
+					   vm_fault(), not by the UTLB
+					   miss handler */
+	u_int32_t vc_page_faults;	/* faults which had to map a page */
+	u_int32_t vc_swapins;		/* pages read from swap */
+	u_int32_t vc_swapouts;		/* pages written to swap */
+	u_int32_t vc_zero_fills;	/* pages first touched, zero filled */
+	u_int32_t vc_file_reads;	/* pages read from a file */
+	u_int32_t vc_cow_copies;	/* copy-on-write faults which copied */
+	u_int32_t vc_fault_lat[VMSTAT_LAT_BUCKETS];	/* fault latency */
+};
+
+struct vmstat {
+	struct vmcounters vs_proc;	/* the calling process */
+	struct vmcounters vs_total;	/* all the processes since boot */
+	u_int32_t vs_rss;		/* frames of the calling process */
+	u_int32_t vs_rss_limit;		/* its resident set limit, 0 if none */
+	u_int32_t vs_frames;		/* frames of the coremap */
+	u_int32_t vs_frames_free;	/* free frames */
+	u_int32_t vs_frames_kernel;	/* kernel frames, or held frames */
+	u_int32_t vs_frames_user;	/* frames mapped by processes */
+	u_int32_t vs_frames_reclaimed;	/* frames freed by exiting processes */
+	u_int32_t vs_frames_migrated;	/* pages moved to make free blocks */
+	u_int32_t vs_frames_zeroed;	/* free frames zeroed in idle time */
+	u_int32_t vs_zeroed_hits;	/* zero filled pages given such a frame */
+	u_int32_t vs_zeroed_misses;	/* zero filled pages zeroed on demand */
+	u_int32_t vs_swap_chunks;	/* chunks of the swap area */
+	u_int32_t vs_swap_used;		/* chunks holding a page */
+	u_int32_t vs_zpool_size;	/* bytes of the compressed swap pool */
+	u_int32_t vs_zpool_used;	/* bytes of it in use */
+	u_int32_t vs_zpool_pages;	/* pages held in it */
+	u_int32_t vs_zpool_bytes;	/* their compressed size */
+	u_int32_t vs_zpool_stores;	/* pages kept in it, disk writes
+					   avoided */
+	u_int32_t vs_zpool_rejects;	/* pages written to disk instead */
+	u_int32_t vs_zpool_hits;	/* pages swapped in from it */
+	u_int32_t vs_zpool_misses;	/* pages swapped in from disk */
+};
+
+#endif /* _KERN_VMSTAT_H_ */
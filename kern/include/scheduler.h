@@ -15,6 +15,9 @@
  *                     already on the run queue or sleeping, weird things
  *                     may happen. Returns an error code.
  *
+ *     scheduler_idle - return nonzero if no thread is waiting to run, for
+ *                      background work which should only take idle time.
+ *
  *     print_run_queue - dump the run queue to the console for debugging.
  *
  *     scheduler_bootstrap - initialize scheduler data 
@@ -28,6 +31,7 @@ struct thread;
 
 struct thread *scheduler(void);
 int make_runnable(struct thread *t);
+int scheduler_idle(void);
 
 void print_run_queue(void);
 
@@ -1,6 +1,7 @@
 #ifndef _SYSCALL_H_
 #define _SYSCALL_H_
 
+struct vmstat;
 
 /*
  * Prototypes for IN-KERNEL entry points for system call implementations.
@@ -34,5 +35,9 @@ int sys_remove(char *pathname, int *retval);
 int sys_rename(char *old_pathname, char *new_pathname, int *retval);
 int sys_fsync(int fd, int *retval);
 int sys_dup2(int oldfd, int newfd, int *retval);
+int sys_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset, int *retval);
+int sys_munmap(void *addr, size_t len, int *retval);
+int sys_msync(void *addr, size_t len, int flags, int *retval);
+int sys_vmstat(struct vmstat *buf, int *retval);
 
 #endif /* _SYSCALL_H_ */
@@ -5,6 +5,10 @@
 #include <bitmap.h>
 
 #include "kern/types.h"
+#include <kern/vmstat.h>
+
+struct addrspace;
+struct mmap_region;
 
 /*
  * VM system-related definitions.
@@ -49,7 +53,7 @@ void free_kpages(vaddr_t addr);
 /*20 bit Page address*/
 //<----------------20------------------->|<---------12---------->|
 //_______________________________________________________________
-//|           Page Address               |N|D|V|G|0|0|0|0|0|0|0|K|  
+//|           Page Address               |N|D|V|G|S|0|F|0|0|0|R|K|  
 //|______________________________________|_______|_______|_______|
 /*Macros for managing attibute bits of a page entry*/
 #define IS_KERNEL(x) ((x) & 0x00000001)
@@ -60,9 +64,49 @@ void free_kpages(vaddr_t addr);
 
 #define IS_DIRTY(x) ((x) & 0x00000400)
 #define SET_DIRTY(x) ((x) | 0x00000400)
+#define CLEAR_DIRTY(x) ((x) & ~0x00000400)
 
 #define ISSWAPPED(x) ((x) & 0x00000080)
 #define SET_SWAPPED(x) ((x) | 0x00000080)
+#define CLEAR_SWAPPED(x) ((x) & ~0x00000080)
+
+/*Coremap entry of a frame in the text cache (shared read-only executable text)*/
+#define IS_TEXT(x) ((x) & 0x00000004)
+#define SET_TEXT(x) ((x) | 0x00000004)
+#define CLEAR_TEXT(x) ((x) & ~0x00000004)
+
+/*
+ * Coremap entry of a frame in transit (being evicted, written back, or not 
+ * mapped yet by the thread which took it). A busy frame is pinned, it is not
+ * replaced, shared or freed by anybody else until add_ppage() or 
+ * remove_ppage() reset it.
+ */
+#define IS_BUSY(x) ((x) & 0x00000010)
+#define SET_BUSY(x) ((x) | 0x00000010)
+#define CLEAR_BUSY(x) ((x) & ~0x00000010)
+
+/*Coremap entry of a frame holding a page of a MAP_SHARED file mapping*/
+#define IS_MAPPED(x) ((x) & 0x00000008)
+#define SET_MAPPED(x) ((x) | 0x00000008)
+#define CLEAR_MAPPED(x) ((x) & ~0x00000008)
+
+/*
+ * Page table entry which the UTLB miss handler in exception.S may load into
+ * the TLB by itself (fast refill): the page is resident and we are its only 
+ * mapper and owner, so the entry without this bit is a valid TLB entry. It 
+ * is set by handle_page_fault() and cleared when the page replacement clears
+ * the reference bit of the frame, so the next miss takes the slow path and 
+ * marks the page referenced again. An entry which loses VALID loses it too.
+ * exception.S tests this bit by value.
+ */
+#define IS_REFILL(x) ((x) & 0x00000020)
+#define SET_REFILL(x) ((x) | 0x00000020)
+#define CLEAR_REFILL(x) ((x) & ~0x00000020)
+
+/*Reference bit of a coremap entry, sampled by CLOCK page replacement*/
+#define IS_REFERENCED(x) ((x) & 0x00000002)
+#define SET_REFERENCED(x) ((x) | 0x00000002)
+#define CLEAR_REFERENCED(x) ((x) & ~0x00000002)
 /*
  * In order to manage the physical page frames, We will maintain a core map, 
  * a sort of reverse page table. Instead of being indexed by virtual addresses, 
@@ -74,11 +118,16 @@ void free_kpages(vaddr_t addr);
 struct _PTE {
 	paddr_t paddr; //physical address of the page
 	vaddr_t vaddr; //virtual address of the page
-	pid_t pid; //process id of the process sharing the page. We don't need to store address space pointer as we can index into process table using pid and can get the address space by accessing the thread structure.
+	pid_t pid; //process id of the process sharing the page.
+	struct addrspace *as; //address space owning the page, its page table is updated when the page is evicted.
 	//u_int64_t last_accces_time; //last accessed time
         u_int32_t last_access_time_sec; //last accessed time (sec)
         u_int32_t last_access_time_nsec; //last accessed time (fraction of second)
 	u_int32_t status; //page status: Kernel, free, dirty, clean, etc.
+	u_int32_t chunk; //swap cache: chunk still holding a copy of a resident page (SWAPPED bit set)
+	u_int32_t refcount; //number of page tables mapping the page (copy-on-write sharing)
+	u_int32_t ws_vtime; //WSClock: virtual time of the owner when the page was last seen referenced
+	int order; //buddy allocator: log2 of the size of the block starting at this frame, -1 inside a block
 };
 /*Initialize the physical memory coremap*/
 void init_coremap();
@@ -87,21 +136,83 @@ void init_coremap();
  * paddr into the coremap. Inverse mapping means the page is indexed by page
  * number calculated using paddr.
  */
-int add_ppage (u_int32_t vaddr, u_int32_t paddr, pid_t pid, u_int32_t status);
+int add_ppage (u_int32_t vaddr, u_int32_t paddr, struct addrspace *as, u_int32_t status);
 /*remove the page table entry mapped with paddr, */
 int remove_ppage (u_int32_t paddr);
 
+/*
+ * Each address space owns a two-level page table (MIPS style 10/10/12 split)
+ * which maps a virtual page to its frame, so a fault on a resident page is 
+ * resolved without searching the coremap. The coremap is only used as the 
+ * reverse map to find the owner of a victim frame during eviction.
+ *
+ * <----10---->|<----10---->|<---------12---------->|
+ * _________________________________________________
+ * | directory |   table    |      page offset      |  Virtual address
+ * |___________|____________|_______________________|
+ *
+ * The directory holds PT_ENTRIES pointers to leaf tables and a leaf table 
+ * holds PT_ENTRIES page table entries. An entry has the same layout as the 
+ * 20 bit page address above: the frame if the page is resident (IS_VALID) 
+ * and the attribute bits. A page that has been swapped out is marked with 
+ * SET_SWAPPED instead of IS_VALID and holds its chunk of the swaparea in 
+ * place of the frame.
+ *
+ * The DIRTY bit of an entry is the TLB write enable bit. A page that was 
+ * swapped in is mapped without it, so the first write to the page takes a 
+ * TLB modify fault and mark_page_dirty() sets it. Until then the chunk the 
+ * page came from still holds the same data (the swap cache, see the chunk 
+ * field of the coremap), and evicting the page needs no disk write.
+ *
+ * fork() shares the pages of the parent with the child (copy-on-write): both
+ * page tables map the same frame, or the same chunk if the page is swapped 
+ * out, with DIRTY cleared, and the refcount of the coremap (swaparea) entry 
+ * counts the page tables mapping it. The first write to a shared page copies
+ * it into a private frame. So DIRTY in a page table entry only means the page
+ * may be written, whether the page differs from its copy in the swap cache is
+ * kept in the status of the coremap entry. Shared frames are never chosen for
+ * replacement, as the coremap only remembers one owner for them.
+ */
+#define PT_ENTRIES 1024
+#define PT_DIR_INDEX(vaddr) (((vaddr) >> 22) & 0x3ff)
+#define PT_TABLE_INDEX(vaddr) (((vaddr) >> 12) & 0x3ff)
+
+/*Allocate an empty page directory*/
+u_int32_t **pt_create(void);
+/*Free the page table of as and drop its references to frames and chunks*/
+void pt_destroy(struct addrspace *as);
+/*
+ * Unmap the pages of as in [start, end), freeing the frames and chunks which
+ * are not shared with another address space.
+ */
+void pt_unmap(struct addrspace *as, vaddr_t start, vaddr_t end);
+/*
+ * Share every page mapped in the page table of old with new, copy-on-write.
+ * Returns ENOMEM if a leaf table of new can't be allocated.
+ */
+int pt_share(struct addrspace *old, struct addrspace *new);
+/*
+ * Return a pointer to the page table entry of vaddr in the page table of as. 
+ * If the leaf table doesn't exist then allocate it if create is set, 
+ * otherwise return NULL.
+ */
+u_int32_t *pt_lookup(struct addrspace *as, vaddr_t vaddr, int create);
+
 
-/*We are using  disk0 to store the swapped pages*/
-#define SWAP_FILE "lhd0raw:";
-/*Initialize the swap area map*/
+/*
+ * We are using disk0 and disk1 to store the swapped pages, see swap_config 
+ * in vm.c for the disks and their priorities. Initialize the swap area map.
+ */
 void init_swaparea();
+/*Initialize the compressed swap pool in front of the swap area*/
+void init_zpool(void);
 /*
  * Add an inverse entry for the swapped out page associated with mapping from 
- * vaddr to paddr into the chunk of the swaparea.
+ * vaddr to paddr into the chunk of the swaparea. The page table entry of 
+ * vaddr in as is pointed to the chunk.
  */
-int add_spage (u_int32_t vaddr, u_int32_t chunk, pid_t pid);
-/*remove the swapped in page from the swap area chunk*/
+int add_spage (u_int32_t vaddr, u_int32_t chunk, struct addrspace *as);
+/*remove the swapped in page from the swap area chunk and its page table entry*/
 int remove_spage (u_int32_t chunk);
 
 /*
@@ -110,9 +221,8 @@ int remove_spage (u_int32_t chunk);
  * 1. Sanity checks: We can't swap the pages holding the page table itself. 
  *    So, check if the paddr lie outside of coremap or not.
  * 2. We use mk_kuio to intiate a read from disk to physical memory.
- * 3. Remove the mapping of the page in the swaparea and unmark the swapmap 
- *    bitmap.
- * 4. Read into the page from disk.
+ * 3. Read into the page from disk. The chunk stays allocated to the page 
+ *    as its swap cache.
  */
 void swapin(u_int32_t paddr, u_int32_t chunk);
 
@@ -130,18 +240,66 @@ void swapin(u_int32_t paddr, u_int32_t chunk);
 void swapout(u_int32_t chunk, u_int32_t paddr);
 
 /*
- * Search the swaparea for the disk resident page addressed by vaddr and 
- * return the paddr of that page. If page doesn't exist then we are in trouble.
+ * Swap out the n pages held by the frames in paddrs into the n contiguous 
+ * chunks starting from chunk with a single write.
+ */
+void swapout_cluster(u_int32_t chunk, u_int32_t *paddrs, int n);
+
+/*
+ * Swap in the n contiguous chunks starting from chunk into the frames in 
+ * paddrs with a single read.
+ */
+void swapin_cluster(u_int32_t chunk, u_int32_t *paddrs, int n);
+
+/*
+ * Get a run of n contiguous empty chunks of the swap area. Returns 0 and the
+ * first chunk in chunk, or ENOSPC if there is no such run.
+ */
+int get_empty_chunks(int n, u_int32_t *chunk);
+
+/*
+ * Return the chunk of the disk resident page addressed by vaddr, which is 
+ * kept in its page table entry. If page doesn't exist then we are in trouble.
  * So, panic if the page is not found in disk as page is supposed to be present 
  * either in disk or in memory. 
  */
-u_int32_t get_spage(u_int32_t vaddr, pid_t pid);
+u_int32_t get_spage(u_int32_t vaddr, struct addrspace *as);
 
 /*
  * Bring back the page from disk into memory by swapping out a victim page if
- * necessary.
+ * necessary. Neighbouring pages swapped out into neighbouring chunks are read
+ * in with it while free frames are plentiful.
+ */
+u_int32_t load_page_into_memory(u_int32_t vaddr, struct addrspace *as);
+
+/*
+ * Map a new zero filled page at vaddr in as (first touch of a heap or stack 
+ * page). A read (write == 0) maps the shared zero page read-only.
+ */
+u_int32_t zero_fill_page(struct addrspace *as, u_int32_t vaddr, int write);
+
+/*
+ * Read a page of the executable which was never touched into a new frame and
+ * map it, zero filling the part of the page which is not in the file (bss). 
+ * A read of a page which is all bss maps the shared zero page instead.
+ * Returns 0 if vaddr is not in a file backed region of as.
+ */
+u_int32_t load_page_from_file(struct addrspace *as, u_int32_t vaddr, int write);
+
+/*
+ * Read a page of a file mapped with mmap() which was never touched into a new
+ * frame and map it. A page of a MAP_SHARED mapping is written back to the file
+ * when it is evicted, a page of a MAP_PRIVATE mapping goes to swap. Returns 0
+ * if vaddr is not in a mapping of as, or write is set and the mapping is not 
+ * writable.
+ */
+u_int32_t load_page_from_mmap(struct addrspace *as, u_int32_t vaddr, int write);
+
+/*
+ * Write back the dirty pages of the MAP_SHARED mapping mr of as in 
+ * [start, end) to its file (msync()). Returns 0 or the error of the write.
  */
-u_int32_t load_page_into_memory(u_int32_t vaddr, pid_t pid);
+int mmap_sync(struct addrspace *as, struct mmap_region *mr, vaddr_t start, vaddr_t end);
 
 /* 
  * This is a core function of our vm. It is responsible to bring the demanded 
@@ -150,8 +308,8 @@ u_int32_t load_page_into_memory(u_int32_t vaddr, pid_t pid);
  * get the page from disk into memory. If memory is full the will find a victim 
  * page to be swapped out.
  * 
- * 1. Check coremap to see whether the page actually present (searching), if not 
- * then legal page fault. Do handle the fault as follows:
+ * 1. Check the page table entry of vaddr to see whether the page is actually 
+ * present, if not then legal page fault. Do handle the fault as follows:
  * 	2.1. As we are loading segment into memory during loadelf(), and during 
  *           page fault the page is not in memory, so the page must be in disk. 
  * 	2.2. Find the chunk of the demanded page in swaparea.
@@ -166,16 +324,75 @@ u_int32_t load_page_into_memory(u_int32_t vaddr, pid_t pid);
  * 	2.4. Make sure to update the coremap to insert the swapped-in page and 
  *           properly mark the page in the bitmap for coremap pages.
  * 	2.5. return the paddr of the page.
- * 3. Check whether the returned paddr is a valid address. If valid return paddr, Otherwise panic.
+ * 3. Return 0 if vaddr is neither in memory nor in disk (not mapped).
  */
-u_int32_t get_ppage(u_int32_t vaddr, pid_t pid);
+u_int32_t get_ppage(struct addrspace *as, u_int32_t vaddr);
 
 /* 
  * This is the interface of our vm to handle tlb/page fault() by calling the
  * get_ppage() to bring the page into memory. It is responsible for updating 
  * the last access time of the page to make our LRU page replacement working.
+ * write is set for a write fault. Returns the frame of the page with DIRTY 
+ * set if the page may be written, or 0 if vaddr is not mapped in the current
+ * address space.
+ */
+u_int32_t handle_page_fault(u_int32_t vaddr, int write);
+
+/*
+ * Handle a write to a page mapped read-only (TLB modify fault). A page shared
+ * copy-on-write is copied into a private frame first. Otherwise the page is 
+ * marked dirty in the page table and the coremap, as its copy in the swap 
+ * cache is no longer current. Returns the frame of the page with DIRTY set, 
+ * or 0 if vaddr is not resident in the current address space.
+ */
+u_int32_t mark_page_dirty(u_int32_t vaddr);
+
+/*
+ * Choose a victim page with the page replacement algorithm in use and mark it
+ * busy, 0 if no user page can be replaced.
+ */
+u_int32_t select_victim(void);
+/*CLOCK page replacement, 0 if no user page can be replaced*/
+u_int32_t replace_clock_page(void);
+/*WSClock page replacement, 0 if no user page can be replaced*/
+u_int32_t replace_wsclock_page(void);
+
+/*
+ * Kernel thread started by vm_bootstrap() which evicts pages in the 
+ * background when the free frames fall below a low watermark, until a high
+ * watermark is reached.
+ */
+void pageout_daemon(void *unused1, unsigned long unused2);
+
+/*
+ * Kernel thread started by vm_bootstrap() which, in idle time, moves user 
+ * pages around so that a free block of COMPACT_ORDER frames is available for
+ * kpage_nalloc().
+ */
+void compact_daemon(void *unused1, unsigned long unused2);
+
+/*
+ * Called by the scheduler with interrupts off while no thread is ready to 
+ * run. Zeroes a free frame ahead of the zero filled page allocations, returns
+ * 1 if there was one to zero.
  */
-u_int32_t handle_page_fault(u_int32_t vaddr);
+int vm_zero_idle(void);
+
+/*
+ * Evict the user page held by the frame paddr. A clean page whose copy in the 
+ * swap cache is current only has its page table entry pointed back to the 
+ * chunk, otherwise the page is written out to swap. Returns ENOSPC if the 
+ * swap area is full, the page then stays resident and is no longer busy.
+ */
+int evict_page(u_int32_t paddr);
+
+/*
+ * Evict the n user pages held by the frames in paddrs, as evict_page(). The 
+ * dirty pages are written out in clusters of contiguous chunks. The entry of
+ * each page left resident for want of swap is cleared in paddrs, returns the
+ * number of such pages.
+ */
+int evict_pages(u_int32_t *paddrs, int n);
 
 /*
  * alloc_page(): allocate a single page:
@@ -196,33 +413,73 @@ u_int32_t handle_page_fault(u_int32_t vaddr);
  * 	=====================================
  * 	Replaces a random page in memory.
  * 
+ * 	3. CLOCK page replacement Algorithm:
+ * 	====================================
+ * 	Sweeps the coremap with a rotating hand and gives referenced pages a 
+ * 	second chance. A page's TLB entry is dropped when its reference bit is
+ * 	cleared, so the page is marked referenced again on its next fault.
+ * 
+ * 	4. WSClock page replacement Algorithm:
+ * 	======================================
+ * 	CLOCK, but an unreferenced page is only replaced if it is also out of 
+ * 	the working set of its owner, i.e. it was not referenced during the 
+ * 	last WS_WINDOW faults of its owner. So a process which thrashes loses
+ * 	its own pages first.
+ * 
  * 5. Once we have found a victim page to swapped out (discussed later) the 
  *    page into a free swap chunk and mark the swapmap appropriately. Return 
  *    the paddr of this page.
  * 6. Insert the page into the coremap and mark the bitmap properly.
+ * 7. Map the page in the page table of as.
  */
 
-u_int32_t alloc_page(u_int32_t vaddr, int pid);
+u_int32_t alloc_page(u_int32_t vaddr, struct addrspace *as);
+/*Same as alloc_page(), for a zero filled page*/
+u_int32_t alloc_zeroed_page(u_int32_t vaddr, struct addrspace *as);
         
-/* Allocate n contiguous kernel pages */
-u_int32_t kpage_nalloc(int n, int pid);
-
-/*Max number of active processes, should be the size of the tlb cache*/
-#define MAX_ACTIVE_PROCESSES 64
-/*contains the allocation status of contagious frames held by a process*/
-struct contagious_frames{
-vaddr_t vaddr;
-size_t npages;
-};
+/* 
+ * Allocate n contiguous kernel pages, a block of the buddy allocator (n is 
+ * rounded up to a power of two). Returns 0 if no block can be made free.
+ */
+u_int32_t kpage_nalloc(int n);
+
+/* Free the kernel pages allocated by kpage_nalloc() starting at paddr */
+void kpage_free(u_int32_t paddr);
+
+/*
+ * Limit the resident set of each process of the process group pgrp to npages
+ * frames (0 removes the limit). A process over its limit evicts its own 
+ * pages, outside of its working set first. Returns EINVAL if npages is too
+ * small to run a process, ENOMEM if there are too many limits already.
+ */
+int vm_set_rss_limit(pid_t pgrp, u_int32_t npages);
 
-/*Page fault statistics*/
+/*Page fault statistics of all the address spaces since boot*/
+struct vmcounters vm_totals;
+/*frames given back by the page tables of exited processes, see pt_destroy()*/
+int total_frames_reclaimed;
+/*user pages moved to another frame to make a free block, see migrate_frame()*/
+int total_frames_migrated;
 
-int total_tlb_faults;
-int total_page_faults;
-int total_asyncpage_write;
+/*
+ * Count n events of the counter field of as (if any) and of vm_totals, see
+ * struct vmcounters in kern/vmstat.h.
+ */
+#define VMSTAT_ADD(as, field, n) do { \
+        struct addrspace *vmstat_as = (as); \
+        vm_totals.field += (n); \
+        if(vmstat_as != NULL) \
+            vmstat_as->as_stats.field += (n); \
+    } while(0)
+
+/*
+ * Fill vs with the counters of as (zero if NULL) and of all the address 
+ * spaces, and the frames and chunks in use.
+ */
+void vmstat_get(struct addrspace *as, struct vmstat *vs);
 
-/*contagious allocation information of the active processes*/
-struct contagious_frames *claimed_frames;
+/*Print the system wide VM statistics (vmstat menu command)*/
+void vmstat_print(void);
 
 /*
  * it should be enabled after the coremape and swaparea have been allocated 
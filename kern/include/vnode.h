@@ -45,6 +45,7 @@ struct vnode {
 struct fdesc {
 	char name[MAX_FILENAME_LEN];
 	int mode;
+	int flags;	/* open flags, O_ACCMODE gives the access mode */
 	off_t offset;
 	int dup_count;
 	struct vnode* vn;
@@ -133,9 +134,9 @@ static struct lock *fs_lock;
  *    vop_fsync       - Force any dirty buffers associated with this file
  *                      to stable storage.
  *
- *    vop_mmap        - Map file into memory. If you implement this
- *                      feature, you're responsible for choosing the
- *                      arguments for this operation.
+ *    vop_mmap        - Check that the file can be mapped into memory
+ *                      with mmap(). The pages of the mapping are read
+ *                      and written back with vop_read and vop_write.
  *
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
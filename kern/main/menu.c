@@ -17,6 +17,7 @@
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
 #include "curthread.h"
 #include "vm.h"
 
@@ -466,6 +467,44 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+#if !OPT_DUMBVM
+static
+int
+cmd_vmstat(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vmstat_print();
+	
+	return 0;
+}
+#endif
+
+#if !OPT_DUMBVM
+/*
+ * Command to limit the resident set of the processes of a process group.
+ * A limit of 0 pages removes it.
+ */
+static
+int
+cmd_rsslimit(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 3) {
+		kprintf("Usage: rsslimit pgrp npages\n");
+		return EINVAL;
+	}
+
+	result = vm_set_rss_limit(atoi(args[1]), atoi(args[2]));
+	if (result == EINVAL) {
+		kprintf("rsslimit: %s pages is too small a limit\n", args[2]);
+	}
+	return result;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -571,6 +610,10 @@ static const char *mainmenu[] = {
 	"[1c] Stoplight                      ",
 #endif
 	"[kh] Kernel heap stats              ",
+#if !OPT_DUMBVM
+	"[vmstat] VM statistics              ",
+	"[rsslimit] Limit resident set       ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -627,6 +670,10 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if !OPT_DUMBVM
+	{ "vmstat",     cmd_vmstat },
+	{ "rsslimit",   cmd_rsslimit },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -781,8 +828,6 @@ menu(char *args)
 	while (1) {
 		kprintf("OS/161 kernel [? for menu]: ");
 		kgets(buf, sizeof(buf));
-		//total_tlb_faults = total_page_faults = total_asyncpage_write = 0;
 		menu_execute(buf, 0);  
-		//kprintf("tlb_faults: %d, page_faults: %d, async_writes: %d\n", total_tlb_faults, total_page_faults, total_asyncpage_write);              
 	}
 }
@@ -48,7 +48,12 @@ pid_t pid_allocate(struct thread* th)
         process_table[i]->exitcv = cv_create(name);
         process_table[i]->exited = 0;
         process_table[i]->parent_pid = -1;
-        process_table[i]->pgrp_id = -1;        
+        //the child of a user process inherits its process group, a program 
+        //started by the kernel (menu) leads a new one
+        if(curthread != NULL && curthread->t_vmspace != NULL && pid_exists(curthread->pid))
+            process_table[i]->pgrp_id = process_table[curthread->pid]->pgrp_id;
+        else
+            process_table[i]->pgrp_id = pid;
         snprintf(name, sizeof(name), "lock_thread%d", pid);
         process_table[i]->exitlock = lock_create(name);        
         //kprintf("process pid_alloc: copying selfthread\n");
@@ -11,6 +11,8 @@
 #include <thread.h>
 #include <machine/spl.h>
 #include <queue.h>
+#include <vm.h>
+#include "opt-dumbvm.h"
 //#include <stdlib.h>
 
 /*
@@ -108,6 +110,17 @@ scheduler(void)
 	assert(curspl>0);
 	
 	while (q_empty(runqueue)) {
+#if !OPT_DUMBVM
+		/*
+		 * Zero a free frame for the VM instead of idling, and take 
+		 * the interrupts which came meanwhile before the next one.
+		 */
+		if (vm_zero_idle()) {
+			spl0();
+			splhigh();
+			continue;
+		}
+#endif
 		cpu_idle();
 	}
 
@@ -292,6 +305,20 @@ make_runnable(struct thread *t)
 	return q_addtail(runqueue, t);
 }
 
+/*
+ * Is the run queue empty? Then the caller is the only thread which wants to
+ * run.
+ */
+int
+scheduler_idle(void)
+{
+	int spl = splhigh();
+	int result = q_empty(runqueue);
+	splx(spl);
+
+	return result;
+}
+
 /*
  * Debugging function to dump the run queue.
  */
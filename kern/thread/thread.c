@@ -595,15 +595,17 @@ mi_switch(threadstate_t nextstate)
 	
 	//DEBUG(DB_VM, "Switching pid from %d to %d.\n", cur->pid, next->pid);
 	/*
-	 * Invalidate the TLB (Added by tocurtis)
+	 * Switch the TLB to the address space of next (Added by tocurtis).
+	 * The TLB entries are tagged with the ASID of their address space, so
+	 * nothing has to be invalidated here.
 	 */
 
     #if OPT_DUMBVM
         //do nothing
     #else
 	
-	if(cur->pid != next->pid)
-		TLB_Invalidate_all();
+	if(next->t_vmspace != NULL)
+		as_activate(next->t_vmspace);
     #endif
 	//TLB_Invalidate_all();
 
@@ -1,11 +1,11 @@
 /*
  * Code to load an ELF-format executable into the current address space.
  *
- * Right now it just copies into userspace and hopes the addresses are
- * mappable to real memory. This works with dumbvm; however, when you
- * write a real VM system, you will need to either (1) add code that 
- * makes the address range used for load valid, or (2) if you implement
- * memory-mapped files, map each segment instead of copying it into RAM.
+ * With dumbvm it just copies into userspace and hopes the addresses are
+ * mappable to real memory. With our VM each segment is mapped from the
+ * executable instead of copying it into RAM: as_define_region() records
+ * where the segment is in the file and its pages are read in on first
+ * fault.
  */
 
 #include <types.h>
@@ -32,6 +32,7 @@
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
  */
+#if OPT_DUMBVM
 static
 int
 load_segment(struct vnode *v, off_t offset, vaddr_t vaddr, 
@@ -80,6 +81,7 @@ load_segment(struct vnode *v, off_t offset, vaddr_t vaddr,
 	
 	return result;
 }
+#endif
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -175,11 +177,26 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_DUMBVM
 		result = as_define_region(curthread->t_vmspace,
 					  ph.p_vaddr, ph.p_memsz,
 					  ph.p_flags & PF_R,
 					  ph.p_flags & PF_W,
 					  ph.p_flags & PF_X);
+#else
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+
+		/* The segment is paged in from v on demand */
+		result = as_define_region(curthread->t_vmspace,
+					  ph.p_vaddr, ph.p_memsz,
+					  ph.p_flags & PF_R,
+					  ph.p_flags & PF_W,
+					  ph.p_flags & PF_X,
+					  v, ph.p_offset, ph.p_filesz);
+#endif
 		if (result) {
 			return result;
 		}
@@ -190,6 +207,8 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
+#if OPT_DUMBVM
+
 	/*
 	 * Now actually load each segment.
 	 */
@@ -227,6 +246,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return result;
 		}
 	}
+#endif
 
 	result = as_complete_load(curthread->t_vmspace);
 	if (result) {
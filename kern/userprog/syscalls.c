@@ -80,6 +80,7 @@ int init_con()
 		kprintf ("vn_fs != NULL!\n");
 	fdesc_init(f_desc0, vn0);
 	f_desc0->mode = 0664; 
+	f_desc0->flags = O_RDONLY;
 	curthread->t_fdtable[0] = f_desc0;
 
 	//kprintf("Setting up STDOUT:\n");
@@ -91,6 +92,7 @@ int init_con()
 		kprintf ("vn_fs != NULL!\n");
 	fdesc_init(f_desc1, vn1);	
 	f_desc1->mode = 0664;
+	f_desc1->flags = O_WRONLY;
 	curthread->t_fdtable[1] = f_desc1;
 
 	
@@ -102,6 +104,7 @@ int init_con()
 		kprintf ("vn_fs != NULL!\n");
 	fdesc_init(f_desc2, vn2);	
 	f_desc2->mode = 0664;
+	f_desc2->flags = O_WRONLY;
 	curthread->t_fdtable[2] = f_desc2;
 	
 	//kprintf("Con set up.\n");
@@ -203,6 +206,7 @@ int sys_open(char *path, int openflags, int mode, int *retval)
 	// Set up the file descriptor
 	fdesc_init(f_desc, vn);	
 	f_desc->mode = mode;
+	f_desc->flags = openflags;
 		
 	//  Without O_APPEND, offset=0
 	//  With O_APPEND, offset = file size (use VOP_STAT)
@@ -716,6 +720,7 @@ int sys_dup2(int oldfd, int newfd, int *retval)
 	strcpy(curthread->t_fdtable[newfd]->name, curthread->t_fdtable[oldfd]->name);
 	
 	curthread->t_fdtable[newfd]->mode = curthread->t_fdtable[oldfd]->mode;
+	curthread->t_fdtable[newfd]->flags = curthread->t_fdtable[oldfd]->flags;
 	curthread->t_fdtable[newfd]->offset = curthread->t_fdtable[oldfd]->offset;
 	curthread->t_fdtable[newfd]->dup_count = curthread->t_fdtable[oldfd]->dup_count;
 	curthread->t_fdtable[newfd]->offset = curthread->t_fdtable[oldfd]->offset;
@@ -1096,8 +1101,7 @@ int sys_sbrk(int size, int *retval)
 {
     struct addrspace *addrsp;
     vaddr_t heaptop;
-    size_t pages;
-    u_int32_t i;
+    vaddr_t newtop;
     
     //save the current heaptop
     addrsp = curthread->t_vmspace;        
@@ -1109,47 +1113,204 @@ int sys_sbrk(int size, int *retval)
         *retval = heaptop;
         return 0;
     }
-    //size can't be less than zero
-    if(size<0) 
+    //the heap can't shrink below its base
+    if(size<0 && (vaddr_t)(-size) > heaptop - addrsp->as_heapbase) 
     {
         *retval = -1;
         return EINVAL;
     }
     
-    pages=(size/PAGE_SIZE)+1;
+    newtop = heaptop + size;
 
-    //allocated size can't exceed the heap limit (i.e. can't fall outside its stackspace)
-    if( (addrsp->as_heaptop+(pages*PAGE_SIZE)) > (USERSTACK+(VM_STACKPAGES*PAGE_SIZE)) ) 
+    //allocated size can't exceed the heap limit (i.e. can't fall into the 
+    //lowest file mapping, or the stackspace if none, or the guard pages below)
+    if( size>0 && newtop > (addrsp->as_mmapbase-(VM_STACKGUARD*PAGE_SIZE)) ) 
     {
         *retval = -1;
         return EINVAL;
     }
 
-    //allocate no_of_pages pages by calling each using allocate_page to allocate
-    //single page. Allocation of each page followed by adding page mapping of 
-    //vaddr to paddr in the page table. alloc_page() will be responsible to call
-    //for this mapping. Note that the virtual address space is contagious but 
-    //physical pages are not necessarily contagious
-    for(i=0;i<pages;i++)
+    //Nothing is allocated here, the heap pages are zero filled by 
+    //handle_page_fault() when they are first touched. When the heap shrinks
+    //we give back the pages which are now entirely above the heaptop.
+    if(size<0)
     {
-        paddr_t res;
-        if(mips_vm_enabled == 0)
-            res=getppages(1);			
-        else
-            res=alloc_page(addrsp->as_heaptop+(i*PAGE_SIZE),addrsp->pid);		    
-        if(res == 0) 
-        {
-            *retval = -1;
-            return ENOMEM;		
-        }
+        pt_unmap(addrsp, (newtop + PAGE_SIZE - 1) & PAGE_FRAME, 
+                 (heaptop + PAGE_SIZE - 1) & PAGE_FRAME);
     }
     
-    //increment the heaptop by the size of the total allocation
-    addrsp->as_heaptop=addrsp->as_heaptop+(pages*PAGE_SIZE);
+    //move the heaptop by the size of the request
+    addrsp->as_heaptop=newtop;
     
-    //return the heaptop
+    //return the old heaptop
     *retval = heaptop;
 
     return 0;
 }
 #endif
+
+#if OPT_DUMBVM
+int sys_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset, int *retval)
+{
+    (void)addr; (void)len; (void)prot; (void)flags; (void)fd; (void)offset;
+    *retval=-1;
+    return EUNIMP;
+}
+
+int sys_munmap(void *addr, size_t len, int *retval)
+{
+    (void)addr; (void)len;
+    *retval=-1;
+    return EUNIMP;
+}
+
+int sys_msync(void *addr, size_t len, int flags, int *retval)
+{
+    (void)addr; (void)len; (void)flags;
+    *retval=-1;
+    return EUNIMP;
+}
+
+int sys_vmstat(struct vmstat *buf, int *retval)
+{
+    (void)buf;
+    *retval=-1;
+    return EUNIMP;
+}
+#else
+/*
+ * mmap() system call implementation. Maps len bytes of the open file fd from
+ * offset (page aligned) into the address space, at an address chosen below 
+ * the stack (addr is ignored). Nothing is read here, the pages are read from
+ * the file when they are first touched (see load_page_from_mmap()).
+ */
+int sys_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset, int *retval)
+{
+    struct addrspace *addrsp = curthread->t_vmspace;
+    struct vnode *vn;
+    struct stat file_stat;
+    vaddr_t vaddr;
+    int result;
+    
+    (void)addr;
+    *retval = -1;
+    
+    if(fd < 0 || fd >= MAX_OPENED_FILES || curthread->t_fdtable[fd] == NULL)
+        return EBADF;
+    if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+        return EINVAL;
+    if((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0)
+        return EINVAL;
+    //the pages are read from the file whatever prot asks for
+    if((curthread->t_fdtable[fd]->flags & O_ACCMODE) == O_WRONLY)
+        return EACCES;
+    //the changes of a shared writable mapping are written back to the file
+    if(flags == MAP_SHARED && (prot & PROT_WRITE) && 
+       (curthread->t_fdtable[fd]->flags & O_ACCMODE) == O_RDONLY)
+        return EACCES;
+    if(len == 0 || offset < 0 || (offset & ~PAGE_FRAME) != 0)
+        return EINVAL;
+    if(len > USERTOP)
+        return ENOMEM;
+    
+    //only the files whose pages can be read and written back can be mapped
+    vn = curthread->t_fdtable[fd]->vn;
+    if(VOP_MMAP(vn) != 0)
+        return ENODEV;
+    
+    //the pages past the current end of the file are never written back
+    result = VOP_STAT(vn, &file_stat);
+    if(result)
+        return result;
+    
+    result = as_define_mmap(addrsp, (len + PAGE_SIZE - 1) / PAGE_SIZE, vn, offset,
+                            file_stat.st_size, prot, flags, &vaddr);
+    if(result)
+        return result;
+    
+    *retval = (int)vaddr;
+    return 0;
+}
+
+/*
+ * munmap() system call implementation. The dirty pages of a shared mapping 
+ * are written back to the file first. Only whole mappings can be unmapped.
+ */
+int sys_munmap(void *addr, size_t len, int *retval)
+{
+    struct addrspace *addrsp = curthread->t_vmspace;
+    struct mmap_region *mr;
+    int result;
+    
+    *retval = -1;
+    
+    mr = as_find_mmap(addrsp, (vaddr_t)addr);
+    if(mr == NULL || mr->mr_vaddr != (vaddr_t)addr || 
+       (len + PAGE_SIZE - 1) / PAGE_SIZE != mr->mr_npages)
+        return EINVAL;
+    
+    result = as_remove_mmap(addrsp, mr);
+    if(result)
+        return result;
+    
+    *retval = 0;
+    return 0;
+}
+
+/*
+ * msync() system call implementation. Writes the dirty pages of a shared 
+ * mapping in [addr, addr+len) back to the file. The write is always done 
+ * before returning, so MS_ASYNC behaves as MS_SYNC.
+ */
+int sys_msync(void *addr, size_t len, int flags, int *retval)
+{
+    struct addrspace *addrsp = curthread->t_vmspace;
+    struct mmap_region *mr;
+    vaddr_t start = (vaddr_t)addr;
+    vaddr_t end;
+    int result;
+    
+    *retval = -1;
+    
+    if((start & ~PAGE_FRAME) != 0 || (flags != MS_ASYNC && flags != MS_SYNC))
+        return EINVAL;
+    
+    //the range must be inside a single mapping
+    mr = as_find_mmap(addrsp, start);
+    end = (start + len + PAGE_SIZE - 1) & PAGE_FRAME;
+    if(mr == NULL || end < start || end > mr->mr_vaddr + mr->mr_npages*PAGE_SIZE)
+        return ENOMEM;
+    
+    //the pages of a private mapping are not written back
+    if(mr->mr_flags == MAP_SHARED)
+    {
+        result = mmap_sync(addrsp, mr, start, end);
+        if(result)
+            return result;
+    }
+    
+    *retval = 0;
+    return 0;
+}
+
+/*
+ * vmstat() system call implementation. Copies out the VM statistics of the
+ * calling process and of the whole system (see kern/vmstat.h).
+ */
+int sys_vmstat(struct vmstat *buf, int *retval)
+{
+    struct vmstat vs;
+    int result;
+    
+    vmstat_get(curthread->t_vmspace, &vs);
+    result = copyout(&vs, (userptr_t)buf, sizeof(struct vmstat));
+    if(result)
+    {
+        *retval = -1;
+        return result;
+    }
+    
+    *retval = 0;
+    return 0;
+}
+#endif
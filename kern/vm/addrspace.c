@@ -6,6 +6,9 @@
 #include <vm.h>
 #include <machine/tlb.h>
 #include <curthread.h>
+#include <vnode.h>
+#include <kern/unistd.h>
+#include <machine/spl.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -33,18 +36,19 @@ etc., just the structure that hold information about the address space.
 
 as_destroy():
 -------------
-Free all the present pages. Also free the swapped pages latter.
-All we need to do in as_destroy() is to call kfree() to destroy the allocation,
-it'll in turn call free_kpages() in mipsvm.c which will be responsible to
-remove the page from the memory.
+Free all the present pages and the swapped pages by walking the page table, so
+the cost depends on the size of the process and not on the size of the coremap.
+Pages still shared copy-on-write only lose a reference. The TLB entries tagged
+with the ASID of the address space are invalidated too.
 
 
 as_activate():
 --------------
 This function activates a given address space as the currently in use one.
-Currently this just invalidates the entire TLB on a context switch .
-In as_activate, we should shoot down all the tlb entries as we are not
-using ASID per process. We need to pass pid in as_copy to work it
+The TLB entries are tagged with a hardware ASID per address space, so on a
+context switch we only load the ASID of the address space (a new one if its
+ASID is from an older generation, see TLB_Activate() in tlb.c) instead of
+shooting down all the tlb entries. We need to pass pid in as_copy to work it
 properly for fork(). So, we need to change our sys_fork() to cope with
 this change.  We need to change all the address management function to
 use alloc_pages() for our vm instead of using getppages() in dumbvm.
@@ -55,26 +59,34 @@ as_define_region():
 -------------------
 Here we should compare addrspaces current heap_start and the region end,
 and set the heap_start right after (vaddr+size). Make sure to properly align the heap_start
-(by page bound).
+(by page bound). We also record where the segment lives in the executable, so its
+pages can be read in on demand.
 
 as_prepare_load():
 -------------------
 this function is called just before the text or data sections are loaded into memory.
-They will just get the required pages for those sections.
-That is we should actually allocate each of the required page in this function so that
-load_segment() in loadelf.c can properly load the required segment.
-Make sure that the allocated segments are zeroed properly. 
+The text and data pages are demand paged from the executable and the stack pages
+are zero filled when they are first touched (up to VM_STACKPAGES below USERSTACK),
+so nothing is allocated here.
 
 as_copy():
 -----------
-Copy each of the preset pages from the old address spaces page table.
-Make sure to copy all the attribute bits (low 12 bits) of the old page table entry.
-We also need to copy all the swapped pages beside present pages as well.
+Share each of the present and swapped pages of the old address spaces page
+table with the new one (copy-on-write, see pt_share() in vm.c). Both page 
+tables lose the write permission of the shared pages, and the first write to 
+a shared page copies it into a private frame.
 
 as_complete_load(), as_define_stack():
 --------------------------------------
 default behavior as dumbvm.c
 
+as_define_mmap(), as_remove_mmap():
+-----------------------------------
+The files mapped by mmap() are placed one below the other from the stack limit
+down towards the heap, with a guard page between them. Their pages are read 
+from the file on the first fault (see load_page_from_mmap() in vm.c). The space
+of an unmapped mapping is only reused once the mappings below it are gone.
+
 */
 
 
@@ -110,7 +122,24 @@ as_create(void)
 	as->as_heaptop = 0;
 	as->as_heapbase = 0;
 	as->pid = curthread->pid; 
+	as->as_file = NULL;
+	//no ASID yet, one is given on the first activation
+	as->as_asid = 0;
+	as->as_asid_gen = 0;
+	//no file mapped yet, the first one goes right below the stack
+	as->as_mmaps = NULL;
+	as->as_mmapbase = VM_STACKLIMIT;
+	bzero(&as->as_stats, sizeof(as->as_stats));
+	as->as_rss = 0;
+	as->as_vtime = 0;
+	as->as_fault_error = 0;
 	
+	//empty page table, leaf tables are allocated as pages get mapped
+	as->as_pgdir = pt_create();
+	if (as->as_pgdir == NULL) {
+		kfree(as);
+		return NULL;
+	}
 
 	return as;
 }
@@ -124,10 +153,7 @@ as_create(void)
 int as_copy(struct addrspace *old, struct addrspace **ret, pid_t pid)
 {
 	struct addrspace *newas;		
-	int i;
-	
-	u_int32_t new_paddr;
-	u_int32_t old_vaddr;
+	struct mmap_region *mr, *newmr;
 	
 	//DEBUG(DB_VM, "\nCopying address space...\n");
 	newas = as_create();
@@ -139,8 +165,16 @@ int as_copy(struct addrspace *old, struct addrspace **ret, pid_t pid)
 	newas->as_npages1 = old->as_npages1;
 	newas->as_vbase2 = old->as_vbase2;
 	newas->as_npages2 = old->as_npages2;
-	newas->as_heaptop = newas->as_heapbase = newas->as_vbase2 + (newas->as_npages2*PAGE_SIZE);
-	// Note that newas->as_heaptop is equal to old->as_heaptop even with the above calculation
+	newas->as_heapbase = old->as_heapbase;
+	newas->as_heaptop = old->as_heaptop;
+	
+	//pages never touched by the parent are read from the same executable
+	newas->as_file = old->as_file;
+	newas->as_file1 = old->as_file1;
+	newas->as_file2 = old->as_file2;
+	if (newas->as_file != NULL) {
+		VOP_INCREF(newas->as_file);
+	}
 
 	//DEBUG(DB_VM, "Old address heap top 0%x:\n", old->as_heaptop);	
 	//DEBUG(DB_VM, "New address heap top 0%x:\n", newas->as_heaptop);
@@ -148,101 +182,29 @@ int as_copy(struct addrspace *old, struct addrspace **ret, pid_t pid)
 	//DEBUG(DB_VM, "Old address space pid: %d\n", old->pid);
 	//DEBUG(DB_VM, "New address space pid: %d\n\n", pid);
 	newas->pid = pid;
-	if (as_prepare_load(newas)) {
-		as_destroy(newas);
-		return ENOMEM;
-	}
-		
-	// These should be set up by now
-	//assert(newas->as_stackpbase != 0);
-	assert(newas->as_heaptop != 0);
-		
-	// Go through the code segment pages and copy everything over
-	for (i=0; i < old->as_npages1; i++)
-	{
-		//get_ppage(newas->as_vbase1 + (i * PAGE_SIZE), newas->pid);
-		//DEBUG(DB_VM, "Grabbed code page.\n");
-		
-		new_paddr = get_ppage(newas->as_vbase1 + (i * PAGE_SIZE), newas->pid);
-		//DEBUG(DB_VM, "New paddr from get_ppage at newas->vbase1: 0x%x\n", new_paddr);
-		new_paddr = new_paddr & PAGE_FRAME;
-		//DEBUG(DB_VM, "New paddr with page frame: 0x%x\n", new_paddr);
-		new_paddr = PADDR_TO_KVADDR(new_paddr);
-		//DEBUG(DB_VM, "New paddr after PADDR_TO_KVADDR: 0x%x\n", new_paddr);
-		old_vaddr = old->as_vbase1 + (i * PAGE_SIZE);
-		//DEBUG(DB_VM, "Old vaddr from old->as_vbase1: 0x%x\n\n", old_vaddr);
-		
-		memmove((void *)(new_paddr),
-			(const void *) (old_vaddr),
-			PAGE_SIZE);	
-			
-		/*
-		memmove((void *)PADDR_TO_KVADDR(get_ppage(newas->as_vbase1 + (i * PAGE_SIZE), newas->pid)),
-			(const void *) (old->as_vbase1 + (i * PAGE_SIZE)),
-			PAGE_SIZE);				
-		*/
-	}
 	
-	//DEBUG(DB_VM, "Moving on.\n");
-	// Check to see if the code copied correctly
-	//DEBUG(DB_VM, "Old address space code at first vaddr: %u\n", old->as_vbase1);
-	//DEBUG(DB_VM, "New address space code at first vaddr: %u\n", newas->as_vbase1);
-
-	// Go through the data segment pages and copy everything over
-	for (i=0; i < old->as_npages2; i++)
-	{
-		
-		new_paddr = get_ppage(newas->as_vbase2 + (i * PAGE_SIZE), newas->pid);
-		//DEBUG(DB_VM, "New paddr from get_ppage at newas->vbase1: 0x%x\n", new_paddr);
-		new_paddr = new_paddr & PAGE_FRAME;
-		//DEBUG(DB_VM, "New paddr with page frame: 0x%x\n", new_paddr);
-		new_paddr = PADDR_TO_KVADDR(new_paddr);
-		//DEBUG(DB_VM, "New vaddr after PADDR_TO_KVADDR: 0x%x\n", new_paddr);
-		old_vaddr = old->as_vbase2 + (i * PAGE_SIZE);
-		//DEBUG(DB_VM, "Old vaddr from old->as_vbase1: 0x%x\n\n", old_vaddr);
-		
-		memmove((void *)(new_paddr),
-			(const void *) (old_vaddr),
-			PAGE_SIZE);	
-		/*
-		memmove((void *)PADDR_TO_KVADDR(get_ppage(newas->as_vbase2 + (i * PAGE_SIZE), newas->pid)),
-			(const void *) (old->as_vbase2 + (i * PAGE_SIZE)),
-			PAGE_SIZE);
-			*/
-	}
-
-	//DEBUG(DB_VM, "Moving on.\n");
-
-	// Go through the stack pages and copy everything over
-	// Stack goes down from max 
-	for (i=0; i < VM_STACKPAGES; i++) 
-	{
-		new_paddr = get_ppage(USERSTACK - ((i+1) * PAGE_SIZE), newas->pid);
-		//DEBUG(DB_VM, "New paddr from get_ppage at stack: 0x%x\n", new_paddr);
-		new_paddr = new_paddr & PAGE_FRAME;
-		new_paddr = PADDR_TO_KVADDR(new_paddr);
-		old_vaddr = USERSTACK - ((i+1) * PAGE_SIZE);
-		
-		memmove((void *)(new_paddr),
-			(const void *) (old_vaddr),
-			PAGE_SIZE);
-		/*
-		memmove((void *)PADDR_TO_KVADDR(get_ppage(USERSTACK - ((i+1) * PAGE_SIZE), newas->pid)),
-			(const void *) (USERSTACK - ((i+1) * PAGE_SIZE)),
-			PAGE_SIZE);
-			*/
+	//the child maps the same files at the same addresses
+	newas->as_mmapbase = old->as_mmapbase;
+	for (mr = old->as_mmaps; mr != NULL; mr = mr->mr_next) {
+		newmr = kmalloc(sizeof(struct mmap_region));
+		if (newmr == NULL) {
+			as_destroy(newas);
+			return ENOMEM;
+		}
+		*newmr = *mr;
+		VOP_INCREF(newmr->mr_file);
+		newmr->mr_next = newas->as_mmaps;
+		newas->as_mmaps = newmr;
 	}
-	//DEBUG(DB_VM, "Moving on.\n");
-	
-	// Go through the heap pages and copy everything over
-	// Heap goes up from heapbase
-	for(;newas->as_heaptop < old->as_heaptop;newas->as_heaptop+=PAGE_SIZE) 
-	{
-		memmove((void *) (PADDR_TO_KVADDR((get_ppage(newas->as_heaptop, pid)) & PAGE_FRAME)), (const void *)newas->as_heaptop,PAGE_SIZE);
-    }
-	//DEBUG(DB_VM, "Moving on.\n");
 	
-	// Copy the attribute bits?
+	/*
+	 * Share the pages of the old address space copy-on-write instead of
+	 * copying them. A page is copied when either of us writes to it.
+	 */
+	if (pt_share(old, newas)) {
+		as_destroy(newas);
+		return ENOMEM;
+	}
 	
 	*ret = newas;
 	return 0;
@@ -255,10 +217,32 @@ int as_copy(struct addrspace *old, struct addrspace **ret, pid_t pid)
 void
 as_destroy(struct addrspace *as)
 {
+	struct mmap_region *mr;
+	
 	/*
 	 * Clean up as needed.
 	 */
 	
+	// The shared file mappings keep what we wrote into them
+	for (mr = as->as_mmaps; mr != NULL; mr = mr->mr_next) {
+		if (mr->mr_flags == MAP_SHARED) {
+			mmap_sync(as, mr, mr->mr_vaddr, 
+				  mr->mr_vaddr + mr->mr_npages*PAGE_SIZE);
+		}
+	}
+	
+	// Drop the TLB entries tagged with our ASID, then give back the
+	// frames and swap chunks nobody else maps (see pt_destroy())
+	TLB_Invalidate_as(as);
+	pt_destroy(as);
+	if (as->as_file != NULL) {
+		VOP_DECREF(as->as_file);
+	}
+	while ((mr = as->as_mmaps) != NULL) {
+		as->as_mmaps = mr->mr_next;
+		VOP_DECREF(mr->mr_file);
+		kfree(mr);
+	}
 	kfree(as);
 }
 
@@ -271,12 +255,15 @@ void
 as_activate(struct addrspace *as)
 {
 	//DEBUG(DB_VM, "AS activating...\n");
-	// This is where we invalidate the TLB
-	TLB_Invalidate_all();
-	//DEBUG(DB_VM, "TLB Invalidated...\n");
-	// Nothing else to do here?
-
-	(void)as;  // suppress warning until code gets written
+	// The TLB entries are tagged with the ASID of their address space, so
+	// we only switch the current ASID, see TLB_Activate()
+	if (as != NULL) {
+		TLB_Activate(as);
+	}
+	else {
+		// no page table for the UTLB miss handler to walk
+		tlb_refill_pgdir = NULL;
+	}
 }
 
 /*
@@ -288,16 +275,29 @@ as_activate(struct addrspace *as)
  * write, or execute permission should be set on the segment. At the
  * moment, these are ignored. When you write the VM system, you may
  * want to implement them.
+ *
+ * The first FILESZ bytes of the segment are at OFFSET in the executable V.
+ * Nothing is read here, the pages are filled from V when they are first
+ * touched (see load_page_from_file() in vm.c).
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
-		 int readable, int writeable, int executable)
+		 int readable, int writeable, int executable,
+		 struct vnode *v, off_t offset, size_t filesz)
 {
 	/*
 	 * Write this.
 	 */
 	
 	size_t npages; 
+	struct region_file rf;
+
+	rf.rf_vaddr = vaddr;
+	rf.rf_offset = offset;
+	rf.rf_filesz = filesz;
+	// The text is never written, so its frames can be shared by all the
+	// address spaces running the same executable
+	rf.rf_shared = executable && !writeable;
 
 	/* Align the region. First, the base... */
 	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
@@ -308,10 +308,8 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	npages = sz / PAGE_SIZE;
 
-	/* We don't use these - all pages are read-write */
+	/* We don't use these - all pages are read-write, but see rf_shared */
 	(void)readable;
-	(void)writeable;
-	(void)executable;
 	
 	//DEBUG(DB_VM, "AS defining region...\n");
 		
@@ -319,9 +317,17 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		and later swap code/data in and out, rather than the whole thing
 		at once. */
 
+	/* Both regions come from the same executable */
+	assert(as->as_file == NULL || as->as_file == v);
+	if (as->as_file == NULL) {
+		VOP_INCREF(v);
+		as->as_file = v;
+	}
+
 	if (as->as_vbase1 == 0) {
 		as->as_vbase1 = vaddr;
 		as->as_npages1 = npages;
+		as->as_file1 = rf;
 
 		// Adjust the heap
 		as->as_heaptop = as->as_heapbase = vaddr + sz; 
@@ -331,6 +337,7 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	if (as->as_vbase2 == 0) {
 		as->as_vbase2 = vaddr;
 		as->as_npages2 = npages;
+		as->as_file2 = rf;
 		
 		// Adjust the heap
 		as->as_heaptop = as->as_heapbase = vaddr + sz; 
@@ -354,107 +361,14 @@ as_prepare_load(struct addrspace *as)
 	/*
 	 * Write this.
 	 */
-	int i;
-	u_int32_t new_paddr;
-	u_int32_t virtual_addr;
-		
-	//assert(as->as_stackpbase == 0);
 	//DEBUG(DB_VM, "AS preparing load...\n");
-	//DEBUG(DB_VM, "Allocating %d code pages...\n", as->as_npages1);
-
-
-	// Handle code segment first
-	for (i=0; i < as->as_npages1; i++)
-	{
-		// Allocate each page
-		//kprintf("Getting virtual address...\n");
-		if(mips_vm_enabled==0)
-		{
-			new_paddr = getppages(1);
-		}
-		else
-		{
-			virtual_addr = as->as_vbase1 + (i*PAGE_SIZE);
-			//kprintf("Getting a new physical address...\n");
-			new_paddr = alloc_page(virtual_addr, as->pid);	
-			
-			//DEBUG(DB_VM, "Allocating virtual code address to core map == 0x%x\n", virtual_addr);
-			//DEBUG(DB_VM, "Corresponds to physical code address == 0x%x\n\n", new_paddr);
-			new_paddr = new_paddr & PAGE_FRAME;
-			//DEBUG(DB_VM, "Corresponds to physical code with page frame address == 0x%x\n\n", new_paddr);
-			
-		}
-
-		if(new_paddr == 0)
-		{
-			return ENOMEM;		
-		}
-		else
-		{
-			(void)new_paddr;
-			//bzero?
-		}
-	}
-
-	//DEBUG(DB_VM, "Allocating %d data pages...\n", as->as_npages2);
-	// Now the data segment
-	for (i=0; i < as->as_npages2; i++)
-	{
-		// Allocate each page
-		if(mips_vm_enabled==0)
-		{
-			new_paddr = getppages(1);
-		}
-		else
-		{
-			virtual_addr = as->as_vbase2 + (i*PAGE_SIZE);
-			new_paddr = alloc_page(virtual_addr, as->pid);
-			//DEBUG(DB_VM, "Adding virtual code address to core map == 0x%x\n", virtual_addr);
-			///DEBUG(DB_VM, "Corresponds to physical code address == 0x%x\n", new_paddr);
-		
-		}
 
-		if(new_paddr == 0)
-		{
-			return ENOMEM;		
-		}
-		else
-		{
-			(void)new_paddr;
-			//bzero?
-		}
-
-	}
-		
-	//DEBUG(DB_VM, "Allocating %d user stack pages...\n", VM_STACKPAGES);
-	// And the stack (stack goes down)
-	for (i=0; i < VM_STACKPAGES; i++) // May need to start at 1 instead of 0
-	{
-		// Allocate each page
-		if(mips_vm_enabled==0)
-		{
-			new_paddr = getppages(1);
-		}
-		else
-		{
-			virtual_addr = USERSTACK - ((i+1)*PAGE_SIZE);
-			new_paddr = alloc_page(virtual_addr, as->pid);
-			// Put the new address into the core map
-			//DEBUG(DB_VM, "Adding virtual code address to core map == 0x%x\n", virtual_addr);
-			//DEBUG(DB_VM, "Corresponds to physical code address == 0x%x\n", new_paddr);
-			//add_ppage(virtual_addr, new_paddr, as->pid, CLEAN);
-		}
-
-		if(new_paddr == 0)
-		{
-			return ENOMEM;		
-		}
-		else
-		{
-			(void)new_paddr;
-			//bzero?
-		}
-	}
+	/*
+	 * The code and data segments are not allocated here, their pages are
+	 * read from the executable on first fault (see as_define_region()).
+	 * Neither is the stack, it grows on demand (see handle_page_fault()).
+	 */
+	(void)as;
 	
 	//DEBUG(DB_VM, "AS preparing load done...\n");
 	return 0;
@@ -497,5 +411,106 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * Map NPAGES pages of V starting at OFFSET (page aligned) below the lowest 
+ * mapping of the address space, leaving a guard page above it and below it,
+ * so neither the mapping above nor the heap (see sys_sbrk()) run into it.
+ * FILESZ is the size of the file, the pages are never written back past it.
+ * Nothing is read here, see load_page_from_mmap().
+ */
+int
+as_define_mmap(struct addrspace *as, size_t npages, struct vnode *v,
+	       off_t offset, off_t filesz, int prot, int flags, vaddr_t *ret)
+{
+	struct mmap_region *mr;
+	vaddr_t top, heaplimit;
+	int spl;
+
+	top = as->as_mmapbase - VM_STACKGUARD*PAGE_SIZE;
+	heaplimit = ((as->as_heaptop + PAGE_SIZE - 1) & PAGE_FRAME) 
+		+ VM_STACKGUARD*PAGE_SIZE;
+	if (npages == 0 || top < heaplimit || npages > (top - heaplimit) / PAGE_SIZE) {
+		return ENOMEM;
+	}
+
+	mr = kmalloc(sizeof(struct mmap_region));
+	if (mr == NULL) {
+		return ENOMEM;
+	}
+	mr->mr_vaddr = top - npages*PAGE_SIZE;
+	mr->mr_npages = npages;
+	mr->mr_file = v;
+	mr->mr_offset = offset;
+	mr->mr_filesz = filesz;
+	mr->mr_prot = prot;
+	mr->mr_flags = flags;
+	VOP_INCREF(v);
+
+	// the eviction code looks mappings up from other threads
+	spl = splhigh();
+	mr->mr_next = as->as_mmaps;
+	as->as_mmaps = mr;
+	as->as_mmapbase = mr->mr_vaddr;
+	splx(spl);
+
+	*ret = mr->mr_vaddr;
+	return 0;
+}
+
+/*
+ * Return the mapping of the address space containing VADDR, or NULL.
+ */
+struct mmap_region *
+as_find_mmap(struct addrspace *as, vaddr_t vaddr)
+{
+	struct mmap_region *mr;
+
+	for (mr = as->as_mmaps; mr != NULL; mr = mr->mr_next) {
+		if (vaddr >= mr->mr_vaddr && 
+		    vaddr < mr->mr_vaddr + mr->mr_npages*PAGE_SIZE) {
+			return mr;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Unmap MR and free it. The dirty pages of a shared mapping are written back
+ * to the file first; if that fails the mapping is left in place.
+ */
+int
+as_remove_mmap(struct addrspace *as, struct mmap_region *mr)
+{
+	struct mmap_region **mrp, *m;
+	vaddr_t end = mr->mr_vaddr + mr->mr_npages*PAGE_SIZE;
+	int result, spl;
+
+	if (mr->mr_flags == MAP_SHARED) {
+		result = mmap_sync(as, mr, mr->mr_vaddr, end);
+		if (result) {
+			return result;
+		}
+	}
+	pt_unmap(as, mr->mr_vaddr, end);
+
+	spl = splhigh();
+	for (mrp = &as->as_mmaps; *mrp != mr; mrp = &(*mrp)->mr_next)
+		;
+	*mrp = mr->mr_next;
+
+	// the mapping may have been the lowest one
+	as->as_mmapbase = VM_STACKLIMIT;
+	for (m = as->as_mmaps; m != NULL; m = m->mr_next) {
+		if (m->mr_vaddr < as->as_mmapbase) {
+			as->as_mmapbase = m->mr_vaddr;
+		}
+	}
+	splx(spl);
+
+	VOP_DECREF(mr->mr_file);
+	kfree(mr);
+	return 0;
+}
+
 #endif
 
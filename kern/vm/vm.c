@@ -19,6 +19,8 @@
 #include <machine/bus.h>
 #include <thread.h>
 #include <curthread.h>
+#include <process.h>
+#include <scheduler.h>
 
 #if OPT_DUMBVM
 //do nothing
@@ -46,6 +48,7 @@ struct _PTE *coremap; //array of page table entries for storing physical pages.
  */
 struct bitmap *core_memmap;
 int coremap_size;/*size of coremap*/
+int coremap_free;/*number of unmarked (free) frames in core_memmap*/
 /*
  * Address of the physical memory where the coremap itself is stored. So the
  * coremap is starting from this address.
@@ -58,17 +61,158 @@ u_int32_t coremap_base;
  * pages.
  */
 struct _PTE *swaparea;
-struct bitmap *swap_memmap;/*we maintain a bitmap to describe the swap area.*/
-struct vnode *swap_fp;/*file pointer to the disk location of the swaparea*/
 int swaparea_size;/*Size of swap area*/
+int swaparea_free;/*number of free chunks on all the swap devices*/
 u_int32_t swap_base;//starting address of the swap area
+/*
+ * The swap area is made of the chunks of each of the swap devices in turn: 
+ * a device holds the sd_size chunks starting from the chunk index sd_base, 
+ * and we maintain a bitmap to describe its chunks. Chunks are allocated from
+ * the devices of the highest priority with room first, round robin among the
+ * devices of the same priority, so the clusters written one after the other 
+ * land on different disks and their I/O (and the read-around of their pages
+ * later) is spread over all of them. A run of chunks never spans two devices.
+ */
+#define SWAP_DEVICES 4
+struct swapdev {
+    const char *sd_name;
+    int sd_prio;/*higher is used first*/
+    struct vnode *sd_vnode;
+    struct bitmap *sd_map;/*chunks in use*/
+    int sd_base;/*index of its first chunk in the swap area*/
+    int sd_size;/*number of chunks*/
+    int sd_free;/*number of free chunks*/
+    u_int32_t sd_reads;/*pages read from it*/
+    u_int32_t sd_writes;/*pages written to it*/
+};
+/*the disks we swap to and their priorities, the missing ones are skipped*/
+static const struct {
+    const char *name;
+    int prio;
+} swap_config[] = {
+    { "lhd0raw:", 0 },
+    { "lhd1raw:", 0 },
+};
+static struct swapdev swapdevs[SWAP_DEVICES];
+static int nswapdevs = 0;
+/*device of the last allocation, the next one of the same priority is next*/
+static int swap_rotor = 0;
+/*
+ * Dirty pages evicted together are copied into this buffer and written out
+ * into a run of contiguous chunks by a single device request, at most 
+ * SWAP_CLUSTER pages at a time (see swapout_cluster()).
+ */
+#define SWAP_CLUSTER 8
+static char *swap_cluster_buf;
+static int swap_cluster_busy = 0;
+/*
+ * Compressed swap pool: a page swapped out is first compressed into this pool
+ * of kernel memory, stolen at boot one ZPOOL_FRACTION of the RAM, and only 
+ * written to its chunk on the disk if it doesn't compress to ZPAGE_MAX bytes 
+ * or the pool is full. The pool is divided into slots of ZSLOT_SIZE bytes, a 
+ * compressed page takes a run of contiguous slots recorded in zpages, indexed
+ * by its chunk. A page stays in the pool as long as its chunk is allocated 
+ * (see remove_spage()), and the pool copy takes the place of the chunk on the
+ * disk, which is never written.
+ */
+#define ZPOOL_FRACTION 16
+#define ZSLOT_SIZE 64
+#define ZPAGE_MAX (PAGE_SIZE/2)
+#define ZPAGE_WORDS (PAGE_SIZE/sizeof(u_int32_t))
+/*marks a run in a compressed page, see zcompress()*/
+#define ZRUN 0x80000000
+struct zpage {
+    int zp_slot;/*first slot of the compressed page, -1 if not in the pool*/
+    int zp_len;/*size of the compressed page in bytes*/
+};
+static char *zpool;
+static struct bitmap *zpool_map;/*slots in use*/
+static int zpool_slots;
+static struct zpage *zpages;/*one for each chunk of the swap area*/
+static u_int32_t zpool_pages;/*pages in the pool*/
+static u_int32_t zpool_bytes;/*size of the compressed pages in the pool*/
+static u_int32_t zpool_stores;/*pages kept in the pool instead of the disk*/
+static u_int32_t zpool_rejects;/*pages written to the disk instead*/
+static u_int32_t zpool_hits;/*pages swapped in from the pool*/
+static u_int32_t zpool_misses;/*pages swapped in from the disk*/
+/*
+ * When a page is swapped in, up to SWAP_READAROUND neighbouring pages on each
+ * side of it, swapped out into the neighbouring chunks, are read in with it
+ * while there are free frames to spare (see load_page_into_memory()).
+ */
+#define SWAP_READAROUND 3
 //int mips_vm_enabled = 0;
 /*
  * Page replacement algorithms
  */
 #define RND 0
 #define LRU 1
-#define PAGE_REPLACEMENT_ALGO RND
+#define CLOCK 2
+#define WSCLOCK 3
+#define PAGE_REPLACEMENT_ALGO WSCLOCK
+
+/*
+ * Working set window of the WSClock page replacement: a page which its owner
+ * didn't reference during its last WS_WINDOW faults is out of its working set.
+ */
+#define WS_WINDOW 64
+
+/*
+ * Hard limits of the resident set of the processes of a process group, in 
+ * frames, see vm_set_rss_limit(). Each process of the group is limited on 
+ * its own. A limit is never below RSS_LIMIT_MIN, so an instruction can 
+ * always have its text, its data and its stack resident.
+ */
+#define RSS_LIMITS 16
+#define RSS_LIMIT_MIN 4
+struct rss_limit {
+    pid_t rl_pgrp;
+    u_int32_t rl_npages; //0 if the slot is unused
+};
+static struct rss_limit rss_limits[RSS_LIMITS];
+
+/*
+ * Buddy allocator of the coremap frames. A block of 2^order frames starts at 
+ * a coremap index which is a multiple of 2^order, and its first entry keeps 
+ * the order (BUDDY_NONE for the other entries). The free blocks of each order
+ * are on a doubly linked list threaded through the free frames themselves, 
+ * with buddy_free_list[order] as its head. An allocated block keeps its order
+ * too, so it is freed in O(log n) without knowing its size.
+ */
+#define BUDDY_MAX_ORDER 10
+#define BUDDY_NONE (-1)
+struct buddy_link {
+    int next; //index of the next free block of the same order, -1 at the end
+    int prev; //index of the previous free block, -1 at the head
+};
+#define BUDDY_LINK(index) ((struct buddy_link *)PADDR_TO_KVADDR(coremap_base + (index)*PAGE_SIZE))
+static int buddy_free_list[BUDDY_MAX_ORDER+1];
+static void buddy_push(int index, int order);
+
+/*
+ * The zero page: a kernel frame which is always zero. A read fault on a page
+ * which was never written (bss, heap or stack) maps it read-only instead of
+ * a new frame. It is shared like a copy-on-write page (its refcount counts
+ * the page tables mapping it, plus the kernel's own reference), so the first
+ * write gets a private zeroed frame from mark_page_dirty().
+ */
+static u_int32_t zero_page;
+
+/*Current position of the hand of the CLOCK and WSClock page replacement algorithms*/
+static int clock_hand = 0;
+
+/*
+ * Locking. The scans of the coremap (victim selection, make_free_block()) 
+ * hold coremap_lock and the scans of the swap bitmaps for free chunks hold 
+ * swapmap_lock, so they run with interrupts enabled and one at a time. 
+ * Each update of a frame, a chunk or a page table entry, and every access to
+ * the TLB, is still a short splhigh() section: a scan only picks a candidate,
+ * which is checked again and claimed (marked busy, see IS_BUSY()) or marked 
+ * in the bitmap in such a section. A frame in transit stays busy while its 
+ * I/O is in flight, so the other faults proceed without waiting for it.
+ */
+static struct lock *coremap_lock;
+static struct lock *swapmap_lock;
 
 //Page status
 typedef enum
@@ -76,21 +220,66 @@ typedef enum
     PAGE_FREE,
     PAGE_DIRTY,
     PAGE_CLEAN,
-    PAGE_KERNEL
+    PAGE_KERNEL,
+    PAGE_IO     //swaparea: the chunk is being written out
 } PAGE_STATUS;
 
+/*
+ * Free frame watermarks of the pageout daemon. It is woken up when the free 
+ * frames fall below PAGEOUT_LOW and evicts pages until PAGEOUT_HIGH frames 
+ * are free, so that faulting threads find a free frame without waiting for 
+ * a swap write.
+ */
+#define PAGEOUT_LOW (coremap_size/16 + 1)
+#define PAGEOUT_HIGH (coremap_size/8 + 2)
+
+/*
+ * The compactor keeps a free block of 2^COMPACT_ORDER frames available, so 
+ * the big kernel allocations don't have to evict user pages, while there are
+ * enough free frames to spare for it.
+ */
+#define COMPACT_ORDER 4
+#define COMPACT_FREE ((1 << COMPACT_ORDER) + PAGEOUT_HIGH)
+
+/*
+ * Frames zeroed by the scheduler while no thread is ready to run (see 
+ * vm_zero_idle()), taken first by the allocations which need a zero filled 
+ * frame. The frames are held busy out of the buddy allocator, at most 
+ * ZERO_POOL of them and only while more than PAGEOUT_HIGH frames are free, 
+ * and are given back when a free frame or block is needed.
+ */
+#define ZERO_POOL 16
+static u_int32_t zero_pool[ZERO_POOL];
+static int zero_pool_count = 0;
+static u_int32_t zero_pool_hits;/*zero filled frames taken from the pool*/
+static u_int32_t zero_pool_misses;/*zero filled frames zeroed on demand*/
+
+/*The pageout daemon sleeps on this address*/
+static int pageout_chan;
+/*Set once the pageout daemon is running*/
+static int pageout_running = 0;
+
 /*
  * Initialize the coremap and swaparea
  */
 void init()
 {        
     mips_vm_enabled = 0;
-    claimed_frames = (struct contagious_frames*)kmalloc(MAX_ACTIVE_PROCESSES*sizeof(struct contagious_frames));	
+    //stolen before the coremap is set up, so it is never paged
+    swap_cluster_buf = (char*)kmalloc(SWAP_CLUSTER*PAGE_SIZE);
+    if(swap_cluster_buf == NULL)
+        panic("VM: Failed to allocate the swap cluster buffer\n");
     init_swaparea();	    
+    init_zpool();
     init_coremap();
 	TLB_Init();
     //now enable our vm
     mips_vm_enabled = 1;
+    
+    zero_page = kpage_nalloc(1);
+    if(zero_page == 0)
+        panic("VM: Failed to allocate the zero page\n");
+    bzero((void *)PADDR_TO_KVADDR(zero_page), PAGE_SIZE);
 }
 
 /*
@@ -98,46 +287,119 @@ void init()
  */
 void vm_bootstrap(void)
 {    
-    //open the disk as a file and use the whle disk0 as the swap space.
-    char file_name[] = SWAP_FILE;     
-    int result = vfs_open(file_name, O_RDWR , &swap_fp);
-    if(result)
-        panic("VM: Failed to create Swap area\n");
+    int result;
     
     //initialize the paging mechanism
     init();
+    coremap_lock = lock_create("coremap");
+    swapmap_lock = lock_create("swapmap");
+    if(coremap_lock == NULL || swapmap_lock == NULL)
+        panic("VM: Failed to create the VM locks\n");
     if(PAGE_REPLACEMENT_ALGO == LRU)
 	    kprintf("Page replacement algorithm: LRU\n\n");
+    else if(PAGE_REPLACEMENT_ALGO == CLOCK)
+	    kprintf("Page replacement algorithm: CLOCK\n\n");
+    else if(PAGE_REPLACEMENT_ALGO == WSCLOCK)
+	    kprintf("Page replacement algorithm: WSCLOCK\n\n");
     else
 	    kprintf("Page replacement algorithm: RANDOM\n\n");
+    
+    //start the pageout daemon
+    result = thread_fork("pageout", NULL, 0, pageout_daemon, NULL);
+    if(result)
+        panic("VM: Failed to start the pageout daemon\n");
+    pageout_running = 1;
+    
+    //and the compactor
+    result = thread_fork("compact", NULL, 0, compact_daemon, NULL);
+    if(result)
+        panic("VM: Failed to start the compactor\n");
 }
 
 /*
- * Initialize the swap area and the bitmap to describe the area. We steal memory 
- * from ram to store these data structures. Initialize each of the page's chunk
- * address.
+ * Initialize the swap area and the bitmaps to describe the area. We open each
+ * of the swap disks as a file and use the whole disk as swap space. We steal 
+ * memory from ram to store these data structures. Initialize each of the 
+ * page's chunk address.
  */
 void init_swaparea() 
 {
     int i;
     struct stat file_stat;    
-    //read the size of the disk0 into file_stat
-    VOP_STAT(swap_fp, &file_stat);   
+    char file_name[32];
+    struct swapdev *sd;
+    
+    swaparea_size = 0;
+    for(i = 0; i < (int)(sizeof(swap_config)/sizeof(swap_config[0])); i++)
+    {
+        assert(nswapdevs < SWAP_DEVICES);
+        sd = &swapdevs[nswapdevs];
+        //vfs_open() may modify the name
+        strcpy(file_name, swap_config[i].name);
+        if(vfs_open(file_name, O_RDWR, &sd->sd_vnode))
+            continue;
+        //read the size of the disk into file_stat
+        VOP_STAT(sd->sd_vnode, &file_stat);   
+        
+        sd->sd_name = swap_config[i].name;
+        sd->sd_prio = swap_config[i].prio;
+        //the size is in PAGE_SIZE unit
+        sd->sd_size = file_stat.st_size/PAGE_SIZE;
+        sd->sd_free = sd->sd_size;
+        sd->sd_base = swaparea_size;
+        //bitmap to describe the chunks of the device (in memory or in disk)
+        sd->sd_map = bitmap_create(sd->sd_size);
+        if(sd->sd_size == 0 || sd->sd_map == NULL)
+        {
+            vfs_close(sd->sd_vnode);
+            continue;
+        }
+        kprintf("swap: %s, %d pages, priority %d\n", sd->sd_name, 
+                sd->sd_size, sd->sd_prio);
+        swaparea_size += sd->sd_size;
+        nswapdevs++;
+    }
+    if(nswapdevs == 0)
+        panic("VM: Failed to create Swap area\n");
     
-    //swaparea size is in PAGE_SIZE unit
-    swaparea_size = file_stat.st_size/PAGE_SIZE;   
-    //bitmap to describe the swaparea (in memory or in disk)
-    swap_memmap = bitmap_create(swaparea_size);    
     //allocate the swaparea into memory by stealing some memory from RAM
     swaparea = (struct _PTE*)kmalloc(swaparea_size * sizeof(struct _PTE));    
 
     //we are initializing swaparea first, so base address should be 0
     swap_base = 0;    
     //set chunk of each of the pages in the swaparea
-    for(i = 0; i < file_stat.st_size/PAGE_SIZE; i++) 
+    for(i = 0; i < swaparea_size; i++) 
     {
         swaparea[i].paddr = (swap_base + (i * PAGE_SIZE));
+        swaparea[i].vaddr = 0;
+        swaparea[i].pid = 0;
+        swaparea[i].as = NULL;
+        swaparea[i].refcount = 0;
+        swaparea[i].status = PAGE_FREE;
     }    
+    swaparea_free = swaparea_size;
+}
+
+/*
+ * Steal the memory of the compressed swap pool from RAM, along with the 
+ * bitmap of its slots and the pool entry of each of the chunks of the swap 
+ * area, which is initialized first.
+ */
+void init_zpool(void)
+{
+    int i;
+    
+    zpool_slots = mips_ramsize() / ZPOOL_FRACTION / ZSLOT_SIZE;
+    zpool = (char*)kmalloc(zpool_slots * ZSLOT_SIZE);
+    zpool_map = bitmap_create(zpool_slots);
+    zpages = (struct zpage*)kmalloc(swaparea_size * sizeof(struct zpage));
+    if(zpool == NULL || zpool_map == NULL || zpages == NULL)
+        panic("VM: Failed to allocate the compressed swap pool\n");
+    for(i = 0; i < swaparea_size; i++)
+    {
+        zpages[i].zp_slot = -1;
+        zpages[i].zp_len = 0;
+    }
 }
 
 /*
@@ -149,6 +411,7 @@ void init_swaparea()
 void init_coremap() 
 {
     int i;
+    int order = 0;
     u_int32_t ram_max = mips_ramsize();
     u_int32_t ram_user_base = ram_stealmem(0);
     
@@ -163,269 +426,1280 @@ void init_coremap()
     //base address for the coremap in the ram, it starts from where the swaparea
     //ended
     coremap_base = ram_stealmem(0);
+    //the coremap and its bitmap took some of the frames we counted above, the
+    //buddy allocator writes into free frames so they must all be in RAM
+    if(coremap_base + coremap_size*PAGE_SIZE > ram_max)
+        coremap_size = (ram_max - coremap_base)/PAGE_SIZE;
     //set each of the page address
     for(i = 0; i < coremap_size; i++) 
     {
         coremap[i].paddr = (coremap_base + (i * PAGE_SIZE));
         coremap[i].status = PAGE_FREE;
+        coremap[i].chunk = 0;
         coremap[i].pid = 0;
+        coremap[i].as = NULL;
+        coremap[i].refcount = 0;
+        coremap[i].order = BUDDY_NONE;
     }   
+    coremap_free = coremap_size;
+    
+    //carve the coremap into the largest aligned free blocks
+    for(i = 0; i <= BUDDY_MAX_ORDER; i++)
+        buddy_free_list[i] = -1;
+    for(i = 0; i < coremap_size; i += (1 << order))
+    {
+        for(order = BUDDY_MAX_ORDER; order > 0; order--)
+            if(i % (1 << order) == 0 && i + (1 << order) <= coremap_size)
+                break;
+        buddy_push(i, order);
+    }
 }
 
-/*
- * Add an inverse entry for the physical page associated with mapping from vaddr 
- * to paddr into the coremap. Inverse mapping means the page is indexed by page
- * number calculated using paddr.
- */
-int add_ppage (u_int32_t vaddr, u_int32_t paddr, pid_t pid, u_int32_t status)
+/*Put the free block starting at index on the free list of its order*/
+static void buddy_push(int index, int order)
 {
-    int result = 0;
-    
-    int spl=splhigh();    
-    paddr = paddr & PAGE_FRAME;
+    struct buddy_link *link = BUDDY_LINK(index);
     
-    //get the index of the page in the page table
-    int page_index = (paddr - coremap_base) / PAGE_SIZE;
-    //make sure that the paddr address is valid
-    assert( (coremap[ page_index ].paddr & PAGE_FRAME) == paddr );
+    coremap[index].order = order;
+    link->prev = -1;
+    link->next = buddy_free_list[order];
+    if(link->next >= 0)
+        BUDDY_LINK(link->next)->prev = index;
+    buddy_free_list[order] = index;
+}
+
+/*Take the free block starting at index off the free list of its order*/
+static void buddy_unlink(int index, int order)
+{
+    struct buddy_link *link = BUDDY_LINK(index);
     
-    /*
-     * Add the mapping and set the attribute bits
-     */
-    coremap[ page_index ].vaddr = vaddr;
-    //If it is a kernel address allocated by kernel then set kernel attribute flag
-    if(vaddr > USERTOP)
-        coremap[ page_index ].paddr = SET_VALID(paddr)|SET_DIRTY(paddr)|SET_KERNEL(paddr);
+    if(link->prev >= 0)
+        BUDDY_LINK(link->prev)->next = link->next;
     else
-        coremap[ page_index ].paddr = SET_VALID(paddr)|SET_DIRTY(paddr);
+        buddy_free_list[order] = link->next;
+    if(link->next >= 0)
+        BUDDY_LINK(link->next)->prev = link->prev;
+    coremap[index].order = BUDDY_NONE;
+}
+
+/*
+ * Allocate the first 2^order frames of the free block of order k starting at
+ * index and mark them in core_memmap. Called with interrupts off.
+ */
+static void buddy_take(int index, int k, int order)
+{
+    int i;
     
-    /*Initialize _PTE fields for this entry*/
-    coremap[ page_index ].last_access_time_sec = 0;
-    coremap[ page_index ].last_access_time_nsec = 0;
-    coremap[ page_index ].pid = pid;
-    coremap[ page_index ].status = PAGE_DIRTY;
+    buddy_unlink(index, k);
+    //the upper halves go back to the free lists
+    while(k > order)
+    {
+        k--;
+        buddy_push(index + (1 << k), k);
+    }
     
-    /*
-     * mark (unavailable) the page entry of coremap.
-     */
-    if(!bitmap_isset(core_memmap,page_index))
-        bitmap_mark(core_memmap, page_index);    
-    splx(spl);
-        
-    return result;
+    coremap[index].order = order;
+    for(i = index; i < index + (1 << order); i++)
+        bitmap_mark(core_memmap, i);
+    coremap_free -= (1 << order);
 }
 
-/*remove the page table entry mapped with paddr, */
-int remove_ppage (u_int32_t paddr)
+/*
+ * Allocate a block of 2^order frames, splitting a bigger free block if 
+ * needed, and mark its frames in core_memmap. Returns the coremap index of 
+ * the first frame, or -1 if there is no free block big enough.
+ */
+static int buddy_alloc(int order)
 {
-    int result = 0;    
-    
     int spl=splhigh();
-    paddr = paddr & PAGE_FRAME;
-    
-    //get the index of the page in the page table
-    int page_index = (paddr - coremap_base) / PAGE_SIZE;
-    //make sure that the paddr address is valid
-    assert((coremap[ page_index ].paddr & PAGE_FRAME) == (paddr & PAGE_FRAME));
+    int k, index;
     
-    /*
-     * Clear the _PTE fields for this entry
-     */
-    coremap[ page_index ].vaddr = 0;
-    coremap[ page_index ].paddr = paddr & PAGE_FRAME;
-    coremap[ page_index ].last_access_time_sec = 0;
-    coremap[ page_index ].last_access_time_nsec = 0;
-    coremap[ page_index ].pid = 0;
-    coremap[ page_index ].status = PAGE_FREE;
+    for(k = order; k <= BUDDY_MAX_ORDER && buddy_free_list[k] < 0; k++)
+        ;
+    if(k > BUDDY_MAX_ORDER)
+    {
+        splx(spl);
+        return -1;
+    }
     
-    /*
-     * umnark the bit of the core memory map to indicate that the page is free
-     */
-    bitmap_unmark(core_memmap, page_index);
-    splx(spl);	
+    index = buddy_free_list[k];
+    buddy_take(index, k, order);
+    splx(spl);
     
-    return result;
+    return index;
 }
 
 /*
- * Add an inverse entry for the swapped out page associated with mapping from 
- * vaddr to chunk into the swaparea.
+ * Allocate a single frame outside of the coremap indexes [lo, hi), an aligned
+ * block which is not free as a whole. A free block then lies either inside or
+ * outside of it, so the first one starting outside will do, the smallest 
+ * first. Returns -1 if there is none.
  */
-int add_spage (u_int32_t vaddr, u_int32_t chunk, pid_t pid)
+static int buddy_alloc_outside(int lo, int hi)
 {
-    int result = 0;
-        
-    //get the index of the chunk in the swap area
-    int chunk_index = (chunk & PAGE_FRAME) / PAGE_SIZE;
-    //make sure that the chunk address is valid
-    assert( (swaparea[ chunk_index ].paddr & PAGE_FRAME) == chunk );
-    if (pid == 0)
-		panic("PID = 0 in add_spage!");
-    /*
-     * Insert a mapping (invert index) of the page addresses by vaddr into the
-     * swap area mapping indexed by the chunk
-     */
     int spl=splhigh();
-    swaparea[ chunk_index ].vaddr = vaddr;
-    swaparea[ chunk_index ].last_access_time_sec = 0;
-    swaparea[ chunk_index ].last_access_time_nsec = 0;
-    //swaparea[ chunk_index ].pid = curthread->pid;
-    swaparea[ chunk_index ].pid = pid; // changed by tocurtis
-
-    /*
-     * mark (as non-empty) the bitmap describing the swap area chunk
-     */
-    if(!bitmap_isset(swap_memmap, chunk_index))
-        bitmap_mark(swap_memmap, chunk_index);
+    int k, index;
     
-    splx(spl);    
-
-    return result;
+    for(k = 0; k <= BUDDY_MAX_ORDER; k++)
+    {
+        for(index = buddy_free_list[k]; index >= 0; index = BUDDY_LINK(index)->next)
+        {
+            if(index < lo || index >= hi)
+            {
+                buddy_take(index, k, 0);
+                splx(spl);
+                return index;
+            }
+        }
+    }
+    splx(spl);
+    return -1;
 }
 
-/*remove the swapped in page from the swap area mapping*/
-int remove_spage (u_int32_t chunk)
+/*Order of the biggest free block, -1 if no frame is free*/
+static int buddy_max_free_order(void)
 {
-    int result = 0;        
-    
-    //get the index of the chunk in the swap area
-    int chunk_index = (chunk & PAGE_FRAME) / PAGE_SIZE;
-    //make sure that the chunk address is valid
-    assert( (swaparea[ chunk_index ].paddr & PAGE_FRAME) == chunk );
-    
-    /*
-     * Clear the swapmap for this chunk
-     */
-    int spl=splhigh();
-    swaparea[ chunk_index ].vaddr = 0;
-    swaparea[ chunk_index ].paddr = chunk;
-    swaparea[ chunk_index ].last_access_time_sec = 0;
-    swaparea[ chunk_index ].last_access_time_nsec = 0;
-    swaparea[ chunk_index ].pid = 0;	
+    int k;
     
-    /*
-     * unmark the memmap for the chunk to indicate that the chunk is free.
-     */
-    bitmap_unmark(swap_memmap, chunk_index);
-    splx(spl);
-    
-    return result;
+    for(k = BUDDY_MAX_ORDER; k >= 0; k--)
+        if(buddy_free_list[k] >= 0)
+            break;
+    return k;
 }
 
 /*
- * Swapin()
- * -----------------------
- * 1. Sanity checks: We can't swap the pages holding the page table itself. 
- *    So, check if the paddr lie outside of coremap or not.
- * 2. We use mk_kuio to intiate a read from disk to physical memory.
- * 3. Remove the mapping of the page in the swaparea and unmark the swapmap 
- *    bitmap.
- * 4. Read into the page from disk.
+ * Free the block starting at index and merge it with its buddy as long as the
+ * buddy is free too.
  */
-void swapin(u_int32_t paddr, u_int32_t chunk)
+static void buddy_free(int index)
 {
-    /*
-     * sanity check: make sure that we are not touching kernel space or the page
-     * table itself .That is the page should be within the coremap memory 
-     * starting from coremap_base
-     */    
-    assert(paddr >= coremap_base);
-    
     int spl=splhigh();
-    /*
-     * Initialize the read I/O into kernel buffer of size PAGE_SIZE starting 
-     * from paddr from the swaparea starting from offset indexed by chunk.
-     */    
-    struct uio swap_uio;
-    mk_kuio(&swap_uio, /*kernel buffer*/(void*)PADDR_TO_KVADDR(paddr & PAGE_FRAME), 
-                       /*Size of the buffer to read into*/PAGE_SIZE, 
-                       /*Starting offset of the swap area for read out */chunk, UIO_READ);        
+    int order = coremap[index].order;
+    int buddy, i;
     
-    /*
-     * Remove the mapping of the chunk to page in the swaparea and unmark the 
-     * swap_memmap bitmap to free the chunk.
-     */
-    remove_spage(chunk);
-    splx(spl);
+    assert(order >= 0 && index % (1 << order) == 0);
+    for(i = index; i < index + (1 << order); i++)
+        bitmap_unmark(core_memmap, i);
+    coremap_free += (1 << order);
+    coremap[index].order = BUDDY_NONE;
     
-    //Now we read the page from memory into kernel buffer pointed with paddr
-    int result=VOP_READ(swap_fp, &swap_uio);
-    if(result) 
-        panic("VM: SWAPIN Failed");    
+    while(order < BUDDY_MAX_ORDER)
+    {
+        buddy = index ^ (1 << order);
+        //the buddy is free only if it is the head of a free block of our size
+        if(buddy + (1 << order) > coremap_size || bitmap_isset(core_memmap, buddy)
+           || coremap[buddy].order != order)
+            break;
+        buddy_unlink(buddy, order);
+        if(buddy < index)
+            index = buddy;
+        order++;
+    }
+    buddy_push(index, order);
+    splx(spl);
 }
 
 /*
- * Swapout()
- * -----------------------
- * 1. Sanity checks: We can't swap the pages holding the page table itself. 
- *    So, check if the paddr lie outside of coremap or not.
- * 2. We use mk_kuio to intiate a write to disk from the physical memory.
- * 3. insert the mapping of the page in the swaparea and mark the swapmap bitmap.
- * 4. Write out the page into disk.
- * 5. Invalidate all the tlb entries by writing TLBHI_INVALID(i) and 
- *    TLBLO_INVALID() into tlb entries.
+ * Allocate an empty page directory. Leaf tables are allocated on demand by
+ * pt_lookup() when the first page they cover is mapped.
  */
-void swapout(u_int32_t chunk, u_int32_t paddr)
+u_int32_t **pt_create(void)
 {
-    /*
-     * sanity check: make sure that we are not swapping out any kernel page or
-     * the address space containing the page table itself.That is the page 
-     * should be within the coremap memory starting from coremap_base
-     */    
-    assert(paddr >= coremap_base);
-    
-    int spl=splhigh();    
-    /*
-     * Initialize the write I/O from kernel buffer of size PAGE_SIZE starting 
-     * from paddr into the swaparea starting from offset indexed by chunk.
-     */
-    struct uio swap_uio;
-    mk_kuio(&swap_uio, /*kernel buffer*/(void*)PADDR_TO_KVADDR(paddr & PAGE_FRAME), 
-                       /*Size of the buffer to writeout*/PAGE_SIZE, 
-                       /*Starting offset of the swap area for write into */chunk, UIO_WRITE);
+    u_int32_t **pgdir;
     
-    /*
-     * Before actual write we should mark the swap area as not-empty to avoid 
-     * inconsistency and add the swapped page into the mapping from the page to 
-     * this chunk.
-     * 
-     */     
-    //get the physical page
-    struct _PTE ppage = coremap[(paddr-coremap_base)/PAGE_SIZE];
-	if (ppage.pid == 0)
-	{
-		panic("PID in swapout == 0!");
-		//DEBUG(DB_VM, "\npid = 0 at coremap[%u] (paddr=0x%x).\n\n", (paddr-coremap_base)/PAGE_SIZE, paddr);
-		//ppage.pid = curthread->pid; // Workaround by tocurtis
-	}
-    DEBUG(DB_VM, "Putting page at address 0x%x into swap area with pid %d.\n", ppage.vaddr, ppage.pid);
-	
-	//add and mark into swaparea
-    add_spage(ppage.vaddr, chunk, ppage.pid);
-    splx(spl);    
+    pgdir = (u_int32_t **)kmalloc(PT_ENTRIES * sizeof(u_int32_t *));
+    if(pgdir == NULL)
+        return NULL;
+    bzero(pgdir, PT_ENTRIES * sizeof(u_int32_t *));
     
-    /*
-     * Now, do the actual writing out the page into disk, we can avoid this 
-     * write if the page is present on disk and it is not dirty. For now we are 
-     * not checking this and always writing to disk (i.e. if already in disk 
-     * then we are overwriting it).      
-     */    
-    int result=VOP_WRITE(swap_fp, &swap_uio);
-    if(result)     
-        panic("VM_SWAP_OUT: Failed");   
+    return pgdir;
+}
+
+/*
+ * Text cache: the frames holding pages of read-only text regions, hashed by
+ * (vnode, vaddr), so every address space running the same executable maps 
+ * the same frames (see load_page_from_file()). A frame stays in the cache 
+ * while it is mapped (IS_TEXT set in its coremap entry), it leaves the cache
+ * when nobody maps it any more, or when it is evicted, written to or freed.
+ * So the vnode can't go away under a cached frame, as each address space 
+ * mapping the frame holds a reference to its vnode.
+ */
+#define TEXT_HASH_SIZE 64
+#define TEXT_HASH(vaddr) (((vaddr) / PAGE_SIZE) % TEXT_HASH_SIZE)
+struct text_page {
+    struct vnode *tp_vnode; //executable
+    vaddr_t tp_vaddr; //virtual address of the page in the text region
+    int tp_index; //coremap index of the frame holding the page
+    struct text_page *tp_next;
+};
+static struct text_page *text_hash[TEXT_HASH_SIZE];
+
+/*Return the coremap index of the cached page vaddr of v, -1 if not cached*/
+static int text_lookup(struct vnode *v, vaddr_t vaddr)
+{
+    struct text_page *tp;
     
-    //Invalidate the corresponding TLB entry in the associative cache
-    spl=splhigh();
-    TLB_Invalidate(paddr);
-    splx(spl);
+    for(tp = text_hash[TEXT_HASH(vaddr)]; tp != NULL; tp = tp->tp_next)
+        if(tp->tp_vnode == v && tp->tp_vaddr == vaddr)
+            return tp->tp_index;
+    return -1;
 }
 
-/*Random Page replacement algorithm*/
-u_int32_t replace_rnd_page () 
+/*Take the frame at page_index out of the text cache*/
+static void text_uncache(int page_index)
 {
-    int spl=splhigh();
-    u_int32_t a_page;
-    /*
+    struct text_page **tpp, *tp;
+    
+    assert(IS_TEXT(coremap[page_index].paddr));
+    for(tpp = &text_hash[TEXT_HASH(coremap[page_index].vaddr)]; *tpp != NULL; tpp = &(*tpp)->tp_next)
+    {
+        if((*tpp)->tp_index == page_index)
+        {
+            tp = *tpp;
+            *tpp = tp->tp_next;
+            kfree(tp);
+            break;
+        }
+    }
+    coremap[page_index].paddr = CLEAR_TEXT(coremap[page_index].paddr);
+}
+
+/*The cached frame at from now is at to, see migrate_frame()*/
+static void text_move(int from, int to)
+{
+    struct text_page *tp;
+    
+    for(tp = text_hash[TEXT_HASH(coremap[from].vaddr)]; tp != NULL; tp = tp->tp_next)
+    {
+        if(tp->tp_index == from)
+        {
+            tp->tp_index = to;
+            break;
+        }
+    }
+}
+
+/*
+ * Make as the owner of the frame at page_index (NULL for none). The frame is
+ * charged to the resident set of its owner, a frame shared copy-on-write only
+ * to one of its sharers. A page leaves the resident set of its owner as soon
+ * as its page table entry no longer points to the frame, see add_spage().
+ */
+static void frame_set_owner(int page_index, struct addrspace *as)
+{
+    if(coremap[page_index].as != NULL)
+        coremap[page_index].as->as_rss--;
+    coremap[page_index].as = as;
+    if(as != NULL)
+    {
+        as->as_rss++;
+        coremap[page_index].pid = as->pid;
+    }
+}
+
+/*
+ * Drop a reference of as to the frame at page_index. If as was the owner 
+ * recorded in the coremap then the owner becomes unknown. A frame nobody maps
+ * any more is left to the eviction code, which frees it without swapping.
+ */
+static void frame_unref(int page_index, struct addrspace *as)
+{
+    assert(coremap[page_index].refcount > 0);
+    coremap[page_index].refcount--;
+    if(coremap[page_index].as == as)
+        frame_set_owner(page_index, NULL);
+    
+    //the last address space running the executable may be gone
+    if(coremap[page_index].refcount == 0 && IS_TEXT(coremap[page_index].paddr))
+        text_uncache(page_index);
+    
+    //nobody can fault the page back in, drop its swap cache
+    if(coremap[page_index].refcount == 0 && ISSWAPPED(coremap[page_index].paddr))
+    {
+        remove_spage(coremap[page_index].chunk);
+        coremap[page_index].paddr = CLEAR_SWAPPED(coremap[page_index].paddr);
+        coremap[page_index].chunk = 0;
+    }
+}
+
+/*
+ * A user frame can be replaced unless it is busy, shared copy-on-write, or its
+ * last sharer is not known yet (it is adopted by get_ppage() on the next 
+ * fault).
+ */
+static int can_replace(int page_index)
+{
+    if(IS_KERNEL(coremap[page_index].paddr) || IS_BUSY(coremap[page_index].paddr))
+        return 0;
+    if(coremap[page_index].refcount > 1)
+        return 0;
+    if(coremap[page_index].refcount == 1 && coremap[page_index].as == NULL)
+        return 0;
+    return 1;
+}
+
+/*
+ * Let the UTLB miss handler refill the TLB with the page at vaddr of as from
+ * now on, if the page is still held by the frame paddr and we are its only
+ * mapper and owner. See REFILL in vm.h.
+ */
+static void pt_set_refill(struct addrspace *as, vaddr_t vaddr, u_int32_t paddr)
+{
+    u_int32_t *pte;
+    int page_index = ((paddr & PAGE_FRAME) - coremap_base) / PAGE_SIZE;
+    
+    int spl=splhigh();
+    pte = pt_lookup(as, vaddr, 0);
+    if(pte != NULL && IS_VALID(*pte) && (*pte & PAGE_FRAME) == (paddr & PAGE_FRAME)
+       && coremap[page_index].refcount == 1 && coremap[page_index].as == as)
+        *pte = SET_REFILL(*pte);
+    splx(spl);
+}
+
+/*
+ * The next TLB miss on the page held by the frame at page_index takes the 
+ * slow path again. Called with interrupts off, when the page replacement 
+ * clears the reference bit of the frame.
+ */
+static void pt_clear_refill(int page_index)
+{
+    u_int32_t *pte;
+    
+    if(coremap[page_index].as == NULL)
+        return;
+    pte = pt_lookup(coremap[page_index].as, coremap[page_index].vaddr, 0);
+    if(pte != NULL && IS_VALID(*pte) 
+       && (*pte & PAGE_FRAME) == (coremap[page_index].paddr & PAGE_FRAME))
+        *pte = CLEAR_REFILL(*pte);
+}
+
+/*
+ * Free the page directory and all of its leaf tables. The references of the 
+ * address space to its resident frames and shared chunks are dropped, so the
+ * eviction code doesn't touch the freed page table. The frames and chunks 
+ * nobody else maps are freed right away, so the cost is proportional to the
+ * page table, not to the coremap. Each entry is dropped in its own splhigh()
+ * section, not the whole walk.
+ */
+void pt_destroy(struct addrspace *as)
+{
+    int i, j;
+    int spl;
+    u_int32_t **pgdir = as->as_pgdir;
+    
+    if(pgdir == NULL)
+        return;
+    
+    for(i = 0; i < PT_ENTRIES; i++)
+    {
+        if(pgdir[i] == NULL)
+            continue;
+        
+        for(j = 0; j < PT_ENTRIES; j++)
+        {
+            if(pgdir[i][j] == 0)
+                continue;
+            
+            spl=splhigh();
+            if(IS_VALID(pgdir[i][j]))
+            {
+                int page_index = ((pgdir[i][j] & PAGE_FRAME) - coremap_base) / PAGE_SIZE;
+                frame_unref(page_index, as);
+                //nobody maps the frame any more, unless it is busy with an 
+                //eviction in flight (which frees it) give it back now
+                if(coremap[page_index].refcount == 0 && !IS_KERNEL(coremap[page_index].paddr)
+                   && !IS_BUSY(coremap[page_index].paddr))
+                {
+                    remove_ppage(coremap[page_index].paddr);
+                    total_frames_reclaimed++;
+                }
+            }
+            else if(ISSWAPPED(pgdir[i][j]))
+            {
+                //a chunk still shared with another address space
+                int chunk_index = (pgdir[i][j] & PAGE_FRAME) / PAGE_SIZE;
+                if(swaparea[chunk_index].refcount > 1)
+                {
+                    swaparea[chunk_index].refcount--;
+                    if(swaparea[chunk_index].as == as)
+                        swaparea[chunk_index].as = NULL;
+                }
+                else
+                {
+                    //let the write of the page finish before the chunk is reused
+                    while(swaparea[chunk_index].status == PAGE_IO)
+                        thread_sleep(&swaparea[chunk_index]);
+                    remove_spage(pgdir[i][j] & PAGE_FRAME);
+                }
+            }
+            pgdir[i][j] = 0;
+            splx(spl);
+        }
+        kfree(pgdir[i]);
+    }
+    //don't let the UTLB miss handler walk the freed tables
+    spl=splhigh();
+    if(tlb_refill_pgdir == pgdir)
+        tlb_refill_pgdir = NULL;
+    splx(spl);
+    kfree(pgdir);
+    as->as_pgdir = NULL;
+}
+
+/*
+ * Return a pointer to the page table entry of vaddr. If the leaf table 
+ * covering vaddr doesn't exist yet then allocate it only if create is set. 
+ * Callers that are going to snatch a frame should create the entry first, 
+ * as allocating the leaf table may itself need a frame.
+ */
+u_int32_t *pt_lookup(struct addrspace *as, vaddr_t vaddr, int create)
+{
+    u_int32_t *table;
+    
+    assert(as != NULL && as->as_pgdir != NULL);
+    
+    table = as->as_pgdir[PT_DIR_INDEX(vaddr)];
+    if(table == NULL)
+    {
+        if(!create)
+            return NULL;
+        
+        table = (u_int32_t *)kmalloc(PT_ENTRIES * sizeof(u_int32_t));
+        if(table == NULL)
+        {
+            as->as_fault_error = ENOMEM;
+            return NULL;
+        }
+        bzero(table, PT_ENTRIES * sizeof(u_int32_t));
+        as->as_pgdir[PT_DIR_INDEX(vaddr)] = table;
+    }
+    
+    return &table[PT_TABLE_INDEX(vaddr)];
+}
+
+/*
+ * Unmap the pages of as in [start, end). Frames and chunks which nobody else
+ * maps are freed, shared ones only lose our reference. Each page is unmapped
+ * in its own splhigh() section.
+ */
+void pt_unmap(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    vaddr_t vaddr;
+    u_int32_t *pte;
+    int spl;
+    
+    for(vaddr = start; vaddr < end; vaddr += PAGE_SIZE)
+    {
+        spl=splhigh();
+        pte = pt_lookup(as, vaddr, 0);
+        if(pte == NULL || *pte == 0)
+        {
+            splx(spl);
+            continue;
+        }
+        
+        if(IS_VALID(*pte))
+        {
+            int page_index = ((*pte & PAGE_FRAME) - coremap_base) / PAGE_SIZE;
+            TLB_Invalidate(*pte & PAGE_FRAME);
+            frame_unref(page_index, as);
+            //unless it is busy with an eviction in flight (which frees it)
+            if(coremap[page_index].refcount == 0 && !IS_KERNEL(coremap[page_index].paddr)
+               && !IS_BUSY(coremap[page_index].paddr))
+                remove_ppage(*pte & PAGE_FRAME);
+        }
+        else if(ISSWAPPED(*pte))
+        {
+            int chunk_index = (*pte & PAGE_FRAME) / PAGE_SIZE;
+            if(swaparea[chunk_index].refcount > 1)
+            {
+                swaparea[chunk_index].refcount--;
+                if(swaparea[chunk_index].as == as)
+                    swaparea[chunk_index].as = NULL;
+            }
+            else
+                remove_spage(*pte & PAGE_FRAME);
+        }
+        *pte = 0;
+        splx(spl);
+    }
+}
+
+/*
+ * Share every page mapped by old with new for fork(). Resident pages share 
+ * the frame and swapped out pages share the chunk, and the page table entries
+ * of both lose DIRTY, so the first write to the page by either of them takes
+ * a TLB modify fault and copies the page (see mark_page_dirty()). The pages 
+ * of a MAP_SHARED file mapping stay shared for writing too.
+ */
+int pt_share(struct addrspace *old, struct addrspace *new)
+{
+    int i, j;
+    u_int32_t *pte;
+    vaddr_t vaddr;
+    
+    for(i = 0; i < PT_ENTRIES; i++)
+    {
+        if(old->as_pgdir[i] == NULL)
+            continue;
+        
+        for(j = 0; j < PT_ENTRIES; j++)
+        {
+            if(old->as_pgdir[i][j] == 0)
+                continue;
+            
+            //allocate the entry first, it may evict a page of old
+            vaddr = (i << 22) | (j << 12);
+            pte = pt_lookup(new, vaddr, 1);
+            if(pte == NULL)
+                return ENOMEM;
+            
+            int spl=splhigh();
+            /*
+             * A busy frame may be on its way out while its owner still maps
+             * it, and only the entry of the owner is pointed to the chunk. 
+             * So wait for the eviction to be over and look at the entry 
+             * again, it points to the chunk or is gone by then.
+             */
+            while(IS_VALID(old->as_pgdir[i][j]) &&
+                  IS_BUSY(coremap[((old->as_pgdir[i][j] & PAGE_FRAME) - coremap_base) / PAGE_SIZE].paddr))
+                thread_sleep(&coremap[((old->as_pgdir[i][j] & PAGE_FRAME) - coremap_base) / PAGE_SIZE]);
+            if(old->as_pgdir[i][j] == 0)
+            {
+                splx(spl);
+                continue;
+            }
+            //a shared frame is refilled by the slow path, see REFILL
+            u_int32_t entry = CLEAR_REFILL(old->as_pgdir[i][j]);
+            if(IS_VALID(entry))
+            {
+                int page_index = ((entry & PAGE_FRAME) - coremap_base) / PAGE_SIZE;
+                coremap[page_index].refcount++;
+                if(IS_MAPPED(coremap[page_index].paddr))
+                {
+                    old->as_pgdir[i][j] = entry;
+                    *pte = entry;
+                    splx(spl);
+                    continue;
+                }
+            }
+            else
+            {
+                assert(ISSWAPPED(entry));
+                int chunk_index = (entry & PAGE_FRAME) / PAGE_SIZE;
+                swaparea[chunk_index].refcount++;
+            }
+            old->as_pgdir[i][j] = CLEAR_DIRTY(entry);
+            *pte = CLEAR_DIRTY(entry);
+            splx(spl);
+        }
+    }
+    
+    //the parent may still have writable entries of the shared pages
+    TLB_Invalidate_all();
+    
+    return 0;
+}
+
+/*
+ * Add an inverse entry for the physical page associated with mapping from vaddr 
+ * to paddr into the coremap. Inverse mapping means the page is indexed by page
+ * number calculated using paddr.
+ */
+int add_ppage (u_int32_t vaddr, u_int32_t paddr, struct addrspace *as, u_int32_t status)
+{
+    int result = 0;
+    
+    int spl=splhigh();    
+    paddr = paddr & PAGE_FRAME;
+    
+    //get the index of the page in the page table
+    int page_index = (paddr - coremap_base) / PAGE_SIZE;
+    //make sure that the paddr address is valid
+    assert( (coremap[ page_index ].paddr & PAGE_FRAME) == paddr );
+    
+    /*
+     * Add the mapping and set the attribute bits
+     */
+    coremap[ page_index ].vaddr = vaddr;
+    //If it is a kernel address allocated by kernel then set kernel attribute flag
+    if(vaddr > USERTOP)
+        coremap[ page_index ].paddr = SET_VALID(paddr)|SET_DIRTY(paddr)|SET_KERNEL(paddr);
+    else if(status == PAGE_CLEAN)
+        coremap[ page_index ].paddr = SET_REFERENCED(SET_VALID(paddr));
+    else
+        coremap[ page_index ].paddr = SET_REFERENCED(SET_VALID(paddr)|SET_DIRTY(paddr));
+    
+    /*Initialize _PTE fields for this entry*/
+    coremap[ page_index ].last_access_time_sec = 0;
+    coremap[ page_index ].last_access_time_nsec = 0;
+    //kernel pages have no address space, they are held by the current thread
+    coremap[ page_index ].pid = curthread->pid;
+    frame_set_owner(page_index, as);
+    coremap[ page_index ].status = status;
+    coremap[ page_index ].chunk = 0;
+    coremap[ page_index ].refcount = 1;
+    coremap[ page_index ].ws_vtime = (as != NULL) ? as->as_vtime : 0;
+    //the frame is not busy any more, see pt_share()
+    thread_wakeup(&coremap[ page_index ]);
+    
+    /*
+     * the frame must have been allocated already (see buddy_alloc()), it is 
+     * marked (unavailable) in the bitmap of the coremap.
+     */
+    assert(bitmap_isset(core_memmap,page_index));
+    splx(spl);
+        
+    return result;
+}
+
+/*remove the page table entry mapped with paddr, */
+int remove_ppage (u_int32_t paddr)
+{
+    int result = 0;    
+    
+    int spl=splhigh();
+    paddr = paddr & PAGE_FRAME;
+    
+    //get the index of the page in the page table
+    int page_index = (paddr - coremap_base) / PAGE_SIZE;
+    //make sure that the paddr address is valid
+    assert((coremap[ page_index ].paddr & PAGE_FRAME) == (paddr & PAGE_FRAME));
+    
+    //the frame is going away, so does its copy in the swap cache
+    if(ISSWAPPED(coremap[ page_index ].paddr))
+        remove_spage(coremap[ page_index ].chunk);
+    if(IS_TEXT(coremap[ page_index ].paddr))
+        text_uncache(page_index);
+    
+    /*
+     * Clear the _PTE fields for this entry
+     */
+    coremap[ page_index ].vaddr = 0;
+    coremap[ page_index ].paddr = paddr & PAGE_FRAME;
+    coremap[ page_index ].last_access_time_sec = 0;
+    coremap[ page_index ].last_access_time_nsec = 0;
+    frame_set_owner(page_index, NULL);
+    coremap[ page_index ].pid = 0;
+    coremap[ page_index ].status = PAGE_FREE;
+    coremap[ page_index ].chunk = 0;
+    coremap[ page_index ].refcount = 0;
+    //the frame is not busy any more, see pt_share()
+    thread_wakeup(&coremap[ page_index ]);
+    coremap[ page_index ].ws_vtime = 0;
+    
+    /*
+     * give the frame back to the buddy allocator, which unmarks the bit of 
+     * the core memory map to indicate that the page is free
+     */
+    if(bitmap_isset(core_memmap, page_index))
+        buddy_free(page_index);
+    splx(spl);	
+    
+    return result;
+}
+
+/*
+ * Return the swap device holding chunk, or NULL if chunk is past the end of 
+ * the swap area.
+ */
+static struct swapdev *swap_dev(u_int32_t chunk)
+{
+    int i;
+    int chunk_index = (chunk & PAGE_FRAME) / PAGE_SIZE;
+    
+    for(i = 0; i < nswapdevs; i++)
+        if(chunk_index >= swapdevs[i].sd_base && 
+           chunk_index < swapdevs[i].sd_base + swapdevs[i].sd_size)
+            return &swapdevs[i];
+    return NULL;
+}
+
+/*
+ * Read or write len bytes of the kernel buffer buf from or into the swap area
+ * starting at chunk, on the swap device holding it. The chunks of the run 
+ * are on the same device, see get_empty_chunks().
+ */
+static int swap_io(u_int32_t chunk, void *buf, size_t len, enum uio_rw rw)
+{
+    struct uio swap_uio;
+    struct swapdev *sd = swap_dev(chunk);
+    
+    assert(sd != NULL && sd == swap_dev(chunk + len - PAGE_SIZE));
+    mk_kuio(&swap_uio, /*kernel buffer*/buf, /*Size of the buffer*/len, 
+            /*offset of the chunk in the device*/
+            (chunk & PAGE_FRAME) - sd->sd_base*PAGE_SIZE, rw);
+    if(rw == UIO_READ)
+    {
+        sd->sd_reads += len/PAGE_SIZE;
+        return VOP_READ(sd->sd_vnode, &swap_uio);
+    }
+    sd->sd_writes += len/PAGE_SIZE;
+    return VOP_WRITE(sd->sd_vnode, &swap_uio);
+}
+
+/*
+ * Add an inverse entry for the swapped out page associated with mapping from 
+ * vaddr to chunk into the swaparea, and store the chunk in the page table 
+ * entry of vaddr so that the page can be found again without searching the 
+ * swaparea.
+ */
+int add_spage (u_int32_t vaddr, u_int32_t chunk, struct addrspace *as)
+{
+    int result = 0;
+    u_int32_t *pte;
+        
+    //get the index of the chunk in the swap area
+    int chunk_index = (chunk & PAGE_FRAME) / PAGE_SIZE;
+    //make sure that the chunk address is valid
+    assert( (swaparea[ chunk_index ].paddr & PAGE_FRAME) == chunk );
+    if (as == NULL || as->pid == 0)
+		panic("No owner in add_spage!");
+    //the page was resident, so its page table entry exists
+    pte = pt_lookup(as, vaddr, 0);
+    assert(pte != NULL);
+    /*
+     * Insert a mapping (invert index) of the page addresses by vaddr into the
+     * swap area mapping indexed by the chunk
+     */
+    int spl=splhigh();
+    //the page is no longer resident, the frame leaves our resident set
+    if(IS_VALID(*pte))
+    {
+        int page_index = ((*pte & PAGE_FRAME) - coremap_base) / PAGE_SIZE;
+        if(coremap[ page_index ].as == as)
+            frame_set_owner(page_index, NULL);
+    }
+    swaparea[ chunk_index ].vaddr = vaddr;
+    swaparea[ chunk_index ].last_access_time_sec = 0;
+    swaparea[ chunk_index ].last_access_time_nsec = 0;
+    swaparea[ chunk_index ].pid = as->pid;
+    swaparea[ chunk_index ].as = as;
+    swaparea[ chunk_index ].refcount = 1;
+    
+    //the page table entry now points to the chunk instead of the frame
+    *pte = (chunk & PAGE_FRAME) | SET_SWAPPED(0);
+
+    /*
+     * mark (as non-empty) the bitmap describing the swap area chunk
+     */
+    struct swapdev *sd = swap_dev(chunk);
+    if(!bitmap_isset(sd->sd_map, chunk_index - sd->sd_base))
+    {
+        bitmap_mark(sd->sd_map, chunk_index - sd->sd_base);
+        sd->sd_free--;
+        swaparea_free--;
+    }
+    
+    splx(spl);    
+
+    return result;
+}
+
+/*
+ * Compress the page at src into dst, or only compute its compressed size if 
+ * dst is NULL. The page is compressed as a sequence of tokens: a token with 
+ * ZRUN set is followed by one word repeated (token & ~ZRUN) times, any other 
+ * token by that many literal words. So a zero filled or same filled page 
+ * takes two words. Returns the size in bytes, or -1 if it is over ZPAGE_MAX.
+ */
+static int zcompress(const u_int32_t *src, u_int32_t *dst)
+{
+    u_int32_t i = 0, out = 0, n;
+    
+    while(i < ZPAGE_WORDS)
+    {
+        for(n = 1; i + n < ZPAGE_WORDS && src[i + n] == src[i]; n++)
+            ;
+        if(n > 1)
+        {
+            if((out + 2) * sizeof(u_int32_t) > ZPAGE_MAX)
+                return -1;
+            if(dst != NULL)
+            {
+                dst[out] = ZRUN | n;
+                dst[out + 1] = src[i];
+            }
+            out += 2;
+            i += n;
+            continue;
+        }
+        //literal words up to the start of the next run
+        for(n = 1; i + n < ZPAGE_WORDS; n++)
+            if(i + n + 1 < ZPAGE_WORDS && src[i + n] == src[i + n + 1])
+                break;
+        if((out + 1 + n) * sizeof(u_int32_t) > ZPAGE_MAX)
+            return -1;
+        if(dst != NULL)
+        {
+            dst[out] = n;
+            memmove(&dst[out + 1], &src[i], n * sizeof(u_int32_t));
+        }
+        out += 1 + n;
+        i += n;
+    }
+    return out * sizeof(u_int32_t);
+}
+
+/*
+ * Decompress the page compressed by zcompress() at src into dst.
+ */
+static void zdecompress(const u_int32_t *src, u_int32_t *dst)
+{
+    u_int32_t i = 0, n, k;
+    
+    while(i < ZPAGE_WORDS)
+    {
+        n = *src & ~ZRUN;
+        assert(n > 0 && i + n <= ZPAGE_WORDS);
+        if(*src & ZRUN)
+        {
+            for(k = 0; k < n; k++)
+                dst[i + k] = src[1];
+            src += 2;
+        }
+        else
+        {
+            memmove(&dst[i], &src[1], n * sizeof(u_int32_t));
+            src += 1 + n;
+        }
+        i += n;
+    }
+}
+
+/*
+ * Find a run of n free slots in the compressed swap pool and mark them, first
+ * fit. Returns the first slot of the run, or -1 if there is none. Called with
+ * interrupts disabled.
+ */
+static int zpool_alloc(int n)
+{
+    int i, run = 0;
+    
+    for(i = 0; i < zpool_slots; i++)
+    {
+        if(bitmap_isset(zpool_map, i))
+        {
+            run = 0;
+            continue;
+        }
+        if(++run == n)
+        {
+            for(i = i - n + 1; run > 0; run--, i++)
+                bitmap_mark(zpool_map, i);
+            return i - n;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Store the page in the frame at paddr into the compressed swap pool as the 
+ * contents of chunk. The frame must be busy and no longer mapped, so it 
+ * doesn't change meanwhile. Returns 0 if the page is in the pool, or ENOSPC if
+ * it doesn't compress well enough or the pool is full, then it must be 
+ * written to the disk.
+ */
+static int zpool_store(u_int32_t chunk, u_int32_t paddr)
+{
+    int chunk_index = (chunk & PAGE_FRAME) / PAGE_SIZE;
+    u_int32_t *src = (u_int32_t*)PADDR_TO_KVADDR(paddr & PAGE_FRAME);
+    int slot;
+    
+    int len = zcompress(src, NULL);
+    int spl=splhigh();
+    assert(zpages[ chunk_index ].zp_slot < 0);
+    slot = len < 0 ? -1 : zpool_alloc((len + ZSLOT_SIZE - 1) / ZSLOT_SIZE);
+    if(slot < 0)
+    {
+        zpool_rejects++;
+        splx(spl);
+        return ENOSPC;
+    }
+    splx(spl);
+    
+    //the slots are ours, compress into them with interrupts enabled
+    zcompress(src, (u_int32_t*)(zpool + slot * ZSLOT_SIZE));
+    
+    spl=splhigh();
+    zpages[ chunk_index ].zp_slot = slot;
+    zpages[ chunk_index ].zp_len = len;
+    zpool_pages++;
+    zpool_bytes += len;
+    zpool_stores++;
+    splx(spl);
+    return 0;
+}
+
+/*
+ * Swap in the page of chunk from the compressed swap pool into the frame at 
+ * paddr. Returns 0, or ENOENT if the page is not in the pool, then it is on 
+ * the disk.
+ */
+static int zpool_load(u_int32_t chunk, u_int32_t paddr)
+{
+    int chunk_index = (chunk & PAGE_FRAME) / PAGE_SIZE;
+    
+    //the pool entry stays until the chunk is freed, which the caller prevents
+    int spl=splhigh();
+    int slot = zpages[ chunk_index ].zp_slot;
+    if(slot < 0)
+        zpool_misses++;
+    else
+        zpool_hits++;
+    splx(spl);
+    if(slot < 0)
+        return ENOENT;
+    
+    zdecompress((u_int32_t*)(zpool + slot * ZSLOT_SIZE), 
+                (u_int32_t*)PADDR_TO_KVADDR(paddr & PAGE_FRAME));
+    return 0;
+}
+
+/*
+ * Free the slots of the page of chunk in the compressed swap pool, if it is 
+ * there. Called with interrupts disabled.
+ */
+static void zpool_drop(int chunk_index)
+{
+    int i;
+    struct zpage *zp = &zpages[ chunk_index ];
+    
+    if(zp->zp_slot < 0)
+        return;
+    for(i = 0; i < (zp->zp_len + ZSLOT_SIZE - 1) / ZSLOT_SIZE; i++)
+        bitmap_unmark(zpool_map, zp->zp_slot + i);
+    zpool_pages--;
+    zpool_bytes -= zp->zp_len;
+    zp->zp_slot = -1;
+    zp->zp_len = 0;
+}
+
+/*
+ * remove the swapped in page from the swap area mapping. If the page table 
+ * entry of the page still points to the chunk then clear it, the caller is 
+ * responsible to map the page again.
+ */
+int remove_spage (u_int32_t chunk)
+{
+    int result = 0;        
+    
+    //get the index of the chunk in the swap area
+    int chunk_index = (chunk & PAGE_FRAME) / PAGE_SIZE;
+    //make sure that the chunk address is valid
+    assert( (swaparea[ chunk_index ].paddr & PAGE_FRAME) == chunk );
+    
+    /*
+     * Clear the swapmap for this chunk
+     */
+    int spl=splhigh();
+    if(swaparea[ chunk_index ].as != NULL)
+    {
+        u_int32_t *pte = pt_lookup(swaparea[ chunk_index ].as, swaparea[ chunk_index ].vaddr, 0);
+        if(pte != NULL && ISSWAPPED(*pte) && (*pte & PAGE_FRAME) == chunk)
+            *pte = 0;
+    }
+    swaparea[ chunk_index ].vaddr = 0;
+    swaparea[ chunk_index ].paddr = chunk;
+    swaparea[ chunk_index ].last_access_time_sec = 0;
+    swaparea[ chunk_index ].last_access_time_nsec = 0;
+    swaparea[ chunk_index ].pid = 0;	
+    swaparea[ chunk_index ].as = NULL;
+    swaparea[ chunk_index ].refcount = 0;
+    zpool_drop(chunk_index);
+    
+    /*
+     * unmark the bitmap of the device for the chunk to indicate that the 
+     * chunk is free.
+     */
+    struct swapdev *sd = swap_dev(chunk);
+    if(bitmap_isset(sd->sd_map, chunk_index - sd->sd_base))
+    {
+        bitmap_unmark(sd->sd_map, chunk_index - sd->sd_base);
+        sd->sd_free++;
+        swaparea_free++;
+    }
+    splx(spl);
+    
+    return result;
+}
+
+/*
+ * Swapin()
+ * -----------------------
+ * 1. Sanity checks: We can't swap the pages holding the page table itself. 
+ *    So, check if the paddr lie outside of coremap or not.
+ * 2. We use mk_kuio to intiate a read from disk to physical memory.
+ * 3. Read into the page from the compressed swap pool if it is there, or 
+ *    from disk. The chunk stays allocated to the page as its swap cache, it 
+ *    is released when the page is written to or freed.
+ */
+void swapin(u_int32_t paddr, u_int32_t chunk)
+{
+    /*
+     * sanity check: make sure that we are not touching kernel space or the page
+     * table itself .That is the page should be within the coremap memory 
+     * starting from coremap_base
+     */    
+    assert(paddr >= coremap_base);
+    
+    int spl=splhigh();
+    //the page may still be on its way out to this chunk, wait for the write
+    while(swaparea[ (chunk & PAGE_FRAME)/PAGE_SIZE ].status == PAGE_IO)
+        thread_sleep(&swaparea[ (chunk & PAGE_FRAME)/PAGE_SIZE ]);
+    splx(spl);
+    
+    if(zpool_load(chunk, paddr) == 0)
+        return;
+    
+    //Now we read the page from the disk into kernel buffer pointed with paddr
+    int result=swap_io(chunk, (void*)PADDR_TO_KVADDR(paddr & PAGE_FRAME), 
+                       PAGE_SIZE, UIO_READ);
+    if(result) 
+        panic("VM: SWAPIN Failed");    
+}
+
+/*
+ * Swapout()
+ * -----------------------
+ * 1. Sanity checks: We can't swap the pages holding the page table itself. 
+ *    So, check if the paddr lie outside of coremap or not.
+ * 2. We use mk_kuio to intiate a write to disk from the physical memory.
+ * 3. insert the mapping of the page in the swaparea and mark the swapmap bitmap.
+ * 4. Write out the page into disk, unless it fits in the compressed swap 
+ *    pool.
+ * 5. Invalidate all the tlb entries by writing TLBHI_INVALID(i) and 
+ *    TLBLO_INVALID() into tlb entries.
+ */
+void swapout(u_int32_t chunk, u_int32_t paddr)
+{
+    /*
+     * sanity check: make sure that we are not swapping out any kernel page or
+     * the address space containing the page table itself.That is the page 
+     * should be within the coremap memory starting from coremap_base
+     */    
+    assert(paddr >= coremap_base);
+    
+    int spl=splhigh();    
+    
+    /*
+     * Before actual write we should mark the swap area as not-empty to avoid 
+     * inconsistency and add the swapped page into the mapping from the page to 
+     * this chunk.
+     * 
+     */     
+    //get the physical page
+    struct _PTE ppage = coremap[(paddr-coremap_base)/PAGE_SIZE];
+    //the owner exited while the page was selected, nothing to write
+    if (ppage.refcount == 0)
+    {
+        remove_spage(chunk);
+        splx(spl);
+        return;
+    }
+	if (ppage.pid == 0 || ppage.as == NULL)
+	{
+		panic("PID in swapout == 0!");
+		//DEBUG(DB_VM, "\npid = 0 at coremap[%u] (paddr=0x%x).\n\n", (paddr-coremap_base)/PAGE_SIZE, paddr);
+		//ppage.pid = curthread->pid; // Workaround by tocurtis
+	}
+    DEBUG(DB_VM, "Putting page at address 0x%x into swap area with pid %d.\n", ppage.vaddr, ppage.pid);
+	
+	//add and mark into swaparea, this also points the page table entry of 
+	//the owner to the chunk
+    add_spage(ppage.vaddr, chunk, ppage.as);
+    VMSTAT_ADD(ppage.as, vc_swapouts, 1);
+    
+    /*
+     * The page is no longer resident, so invalidate the corresponding TLB 
+     * entry in the associative cache before the write, so the owner faults on
+     * it from now on.
+     */
+    TLB_Invalidate(paddr);
+    
+    /*
+     * A fault on the page waits in swapin() until the chunk is written.
+     */
+    swaparea[ (chunk & PAGE_FRAME)/PAGE_SIZE ].status = PAGE_IO;
+    splx(spl);    
+    
+    /*
+     * Now, do the actual writing out the page into disk. Clean pages with a 
+     * current copy in the swap cache never get here, see evict_page().
+     */    
+    if(zpool_store(chunk, paddr) != 0)
+    {
+        int result=swap_io(chunk, (void*)PADDR_TO_KVADDR(paddr & PAGE_FRAME), 
+                           PAGE_SIZE, UIO_WRITE);
+        if(result)     
+            panic("VM_SWAP_OUT: Failed");   
+    }
+    
+    spl=splhigh();
+    swaparea[ (chunk & PAGE_FRAME)/PAGE_SIZE ].status = PAGE_FREE;
+    thread_wakeup(&swaparea[ (chunk & PAGE_FRAME)/PAGE_SIZE ]);
+    splx(spl);
+}
+
+/*
+ * Swap out the n pages held by the frames in paddrs into the n contiguous 
+ * chunks starting from chunk, with one write. Same as swapout() for each of 
+ * the pages, except that the pages are copied into the cluster buffer first,
+ * as the frames are not contiguous in memory. Pages which fit in the 
+ * compressed swap pool skip the disk, so there is one write for each run of 
+ * consecutive pages which didn't.
+ */
+void swapout_cluster(u_int32_t chunk, u_int32_t *paddrs, int n)
+{
+    int i, first;
+    int chunk_index = (chunk & PAGE_FRAME)/PAGE_SIZE;
+    int unowned[SWAP_CLUSTER];
+    int ondisk[SWAP_CLUSTER];
+    
+    assert(n > 0 && n <= SWAP_CLUSTER);
+    
+    int spl=splhigh();
+    //one cluster write at a time through the buffer
+    while(swap_cluster_busy)
+        thread_sleep(&swap_cluster_busy);
+    swap_cluster_busy = 1;
+    
+    for(i = 0; i < n; i++)
+    {
+        assert((paddrs[i] & PAGE_FRAME) >= coremap_base);
+        struct _PTE ppage = coremap[((paddrs[i] & PAGE_FRAME)-coremap_base)/PAGE_SIZE];
+        //the owner exited while we waited for the buffer, the chunk is freed
+        //after the write so nobody else writes into the run meanwhile
+        unowned[i] = (ppage.refcount == 0);
+        if (unowned[i])
+            continue;
+        if (ppage.pid == 0 || ppage.as == NULL)
+            panic("PID in swapout_cluster == 0!");
+        
+        //point the page table entry of the owner to its chunk
+        add_spage(ppage.vaddr, chunk + i*PAGE_SIZE, ppage.as);
+        VMSTAT_ADD(ppage.as, vc_swapouts, 1);
+        TLB_Invalidate(paddrs[i] & PAGE_FRAME);
+        swaparea[ chunk_index + i ].status = PAGE_IO;
+    }
+    splx(spl);
+    
+    //the frames are busy and no longer mapped, so they don't change meanwhile
+    for(i = 0; i < n; i++)
+    {
+        ondisk[i] = !unowned[i] && 
+                    zpool_store(chunk + i*PAGE_SIZE, paddrs[i]) != 0;
+        if(ondisk[i])
+            memmove(swap_cluster_buf + i*PAGE_SIZE, 
+                    (void*)PADDR_TO_KVADDR(paddrs[i] & PAGE_FRAME), PAGE_SIZE);
+    }
+    
+    for(i = 0; i < n; i++)
+    {
+        if(!ondisk[i])
+            continue;
+        for(first = i; i + 1 < n && ondisk[i + 1]; i++)
+            ;
+        int result=swap_io(chunk + first*PAGE_SIZE, 
+                           swap_cluster_buf + first*PAGE_SIZE, 
+                           (i-first+1)*PAGE_SIZE, UIO_WRITE);
+        if(result)     
+            panic("VM_SWAP_OUT: Failed");   
+    }
+    
+    spl=splhigh();
+    for(i = 0; i < n; i++)
+    {
+        swaparea[ chunk_index + i ].status = PAGE_FREE;
+        thread_wakeup(&swaparea[ chunk_index + i ]);
+        if(unowned[i])
+            remove_spage(chunk + i*PAGE_SIZE);
+    }
+    swap_cluster_busy = 0;
+    thread_wakeup(&swap_cluster_busy);
+    splx(spl);
+}
+
+/*
+ * Swap in the n contiguous chunks starting from chunk into the frames in 
+ * paddrs with one read, through the cluster buffer. The chunks stay allocated
+ * as in swapin(). Pages in the compressed swap pool are taken from there, the
+ * others are read with one read for each run of consecutive chunks.
+ */
+void swapin_cluster(u_int32_t chunk, u_int32_t *paddrs, int n)
+{
+    int i, first;
+    int chunk_index = (chunk & PAGE_FRAME)/PAGE_SIZE;
+    int pooled[SWAP_CLUSTER];
+    
+    assert(n > 0 && n <= SWAP_CLUSTER);
+    
+    int spl=splhigh();
+    while(swap_cluster_busy)
+        thread_sleep(&swap_cluster_busy);
+    swap_cluster_busy = 1;
+    //the pages may still be on their way out to these chunks
+    for(i = 0; i < n; i++)
+        while(swaparea[ chunk_index + i ].status == PAGE_IO)
+            thread_sleep(&swaparea[ chunk_index + i ]);
+    splx(spl);
+    
+    for(i = 0; i < n; i++)
+    {
+        assert((paddrs[i] & PAGE_FRAME) >= coremap_base);
+        pooled[i] = (zpool_load(chunk + i*PAGE_SIZE, paddrs[i]) == 0);
+    }
+    
+    for(i = 0; i < n; i++)
+    {
+        if(pooled[i])
+            continue;
+        for(first = i; i + 1 < n && !pooled[i + 1]; i++)
+            ;
+        int result=swap_io(chunk + first*PAGE_SIZE, 
+                           swap_cluster_buf + first*PAGE_SIZE, 
+                           (i-first+1)*PAGE_SIZE, UIO_READ);
+        if(result) 
+            panic("VM: SWAPIN Failed");    
+    }
+    
+    for(i = 0; i < n; i++)
+        if(!pooled[i])
+            memmove((void*)PADDR_TO_KVADDR(paddrs[i] & PAGE_FRAME), 
+                    swap_cluster_buf + i*PAGE_SIZE, PAGE_SIZE);
+    
+    spl=splhigh();
+    swap_cluster_busy = 0;
+    thread_wakeup(&swap_cluster_busy);
+    splx(spl);
+}
+
+/*
+ * Claim the frame at page_index as a victim if it can still be replaced: the
+ * scans look at the coremap with interrupts enabled, so the frame is checked
+ * again and marked busy atomically. Returns 1 if it was claimed.
+ */
+static int claim_victim(int page_index)
+{
+    int spl=splhigh();
+    if(!can_replace(page_index) || !IS_VALID(coremap[page_index].paddr))
+    {
+        splx(spl);
+        return 0;
+    }
+    coremap[page_index].paddr = SET_BUSY(coremap[page_index].paddr);
+    splx(spl);
+    return 1;
+}
+
+/*Random Page replacement algorithm, returns 0 if no page can be replaced*/
+u_int32_t replace_rnd_page () 
+{
+    u_int32_t a_page;
+    int tries = 0;
+    
+    lock_acquire(coremap_lock);
+    /*
      * Get a random page to replace.
      * Make sure that we are not replacing kernel space pages, kernel pages
      * are fixed, non-mapped.
@@ -433,9 +1707,22 @@ u_int32_t replace_rnd_page ()
     do
     {
         a_page = random()%coremap_size;		
-    }while(IS_KERNEL(coremap[a_page].paddr));
+        //unlucky, fall back to the first page we can replace
+        if(++tries > 2*coremap_size)
+        {
+            for(a_page = 0; a_page < (u_int32_t)coremap_size; a_page++)
+                if(claim_victim(a_page))
+                    break;
+            if(a_page == (u_int32_t)coremap_size)
+            {
+                lock_release(coremap_lock);
+                return 0;
+            }
+            break;
+        }
+    }while(!claim_victim(a_page));
     
-    splx(spl);
+    lock_release(coremap_lock);
     
     /*Sanity check: Kernel page can't be swapped out*/
     if(coremap[a_page].vaddr > USERTOP)
@@ -445,139 +1732,776 @@ u_int32_t replace_rnd_page ()
 }
 
 /*
- * Least Recent Used page replacement algorithm.
+ * Least Recent Used page replacement algorithm, returns 0 if no page can be 
+ * replaced.
  */
 u_int32_t replace_lru_page () 
 {
-    int spl=splhigh();
-
     int i;
-    u_int32_t lru_page;
+    int lru_page;
     time_t sec; 
     u_int32_t nsec;
-    /*Get current time in sec and nanosec*/
-    gettime(&sec, &nsec);        
-    u_int32_t currsec=sec, currnsec=nsec;
-    //u_int32_t currsec = system_counter;
+    u_int32_t currsec, currnsec;
+    
+    lock_acquire(coremap_lock);
+    /*
+     * The scan runs with interrupts enabled, so the page found may have 
+     * changed meanwhile, then search again.
+     */
+    do
+    {
+        lru_page = -1;
+        /*Get current time in sec and nanosec*/
+        gettime(&sec, &nsec);        
+        currsec=sec;
+        currnsec=nsec;
+        //u_int32_t currsec = system_counter;
+
+        /*Search for the oldest 'userspace' page used*/
+        for(i=0;i< (int)coremap_size;i++)
+        {
+            if(  can_replace(i) && IS_VALID(coremap[i].paddr)
+                 && (coremap[i].last_access_time_sec <= currsec)
+                 /*&& (coremap[i].last_access_time_nsec <= currnsec)*/)
+            {
+                    currsec = coremap[i].last_access_time_sec;
+                    //currnsec = coremap[i].last_access_time_nsec;
+                    lru_page = i;
+            }
+        }
+    }while(lru_page >= 0 && !claim_victim(lru_page));
+    lock_release(coremap_lock);
+    
+    if(lru_page < 0)
+        return 0;
+    
+    /*Sanity check: Kernel page can't be swapped out*/
+    if(coremap[lru_page].vaddr > USERTOP)
+        panic("VM_LRU_PAGE_REPLACE: SWAPPING OUT KERNEL PAGE");
 
-    /*Search for the oldest 'userspace' page used*/
-    for(i=0;i< (int)coremap_size;i++)
+    return(coremap[lru_page].paddr);
+}
+
+/*
+ * CLOCK (second chance) page replacement algorithm.
+ * 
+ * The hand sweeps the coremap circularly. A referenced user page gets a 
+ * second chance: its reference bit is cleared and its TLB entry is 
+ * invalidated, so the next access to the page faults and handle_page_fault()
+ * marks it referenced again. The first unreferenced user page is the victim.
+ * The hand stays where it stopped, so an eviction costs O(1) amortized.
+ * Returns 0 if no page can be replaced.
+ */
+u_int32_t replace_clock_page(void)
+{
+    int spl;
+    int i;
+    int victim;
+    
+    lock_acquire(coremap_lock);
+    /*
+     * Two sweeps are enough, all reference bits are clear after the first. 
+     * Each step of the hand is a short splhigh() section of its own.
+     */
+    for(i = 0; i < 2*coremap_size; i++)
     {
-        if(  !(IS_KERNEL(coremap[i].paddr))
-             && (coremap[i].last_access_time_sec <= currsec)
-             /*&& (coremap[i].last_access_time_nsec <= currnsec)*/)
+        victim = clock_hand;
+        clock_hand = (clock_hand + 1) % coremap_size;
+        
+        spl=splhigh();
+        //kernel and shared pages are fixed, skip them and frames not yet mapped
+        if(!can_replace(victim) || !IS_VALID(coremap[victim].paddr))
+        {
+            splx(spl);
+            continue;
+        }
+        
+        if(IS_REFERENCED(coremap[victim].paddr))
         {
-                currsec = coremap[i].last_access_time_sec;
-                //currnsec = coremap[i].last_access_time_nsec;
-                lru_page = i;
+            coremap[victim].paddr = CLEAR_REFERENCED(coremap[victim].paddr);
+            pt_clear_refill(victim);
+            TLB_Invalidate(coremap[victim].paddr & PAGE_FRAME);
+            splx(spl);
+            continue;
         }
+        
+        coremap[victim].paddr = SET_BUSY(coremap[victim].paddr);
+        splx(spl);
+        lock_release(coremap_lock);
+        
+        /*Sanity check: Kernel page can't be swapped out*/
+        if(coremap[victim].vaddr > USERTOP)
+            panic("VM_CLOCK_PAGE_REPLACE: SWAPPING OUT KERNEL PAGE");
+        
+        return(coremap[victim].paddr);
     }
+    
+    lock_release(coremap_lock);
+    return 0;
+}
 
-    splx(spl);
+/*
+ * WSClock page replacement algorithm.
+ * 
+ * The hand sweeps the coremap as in CLOCK, and a referenced page gets a second
+ * chance and is stamped with the virtual time of its owner. The virtual time 
+ * of an address space advances with its own faults (see handle_page_fault()),
+ * so the first unreferenced page its owner didn't reference during its last 
+ * WS_WINDOW faults is out of the working set of its owner and is the victim.
+ * A process which thrashes ages its own pages, while the pages of a process 
+ * which runs within its working set stay. A frame nobody maps any more is 
+ * taken right away. If every page left is in a working set then the oldest 
+ * one is the victim.
+ * 
+ * If only is not NULL then only the pages owned by only are considered. The 
+ * frame at keep (-1 for none) is skipped. Returns 0 if no page can be 
+ * replaced.
+ */
+static u_int32_t wsclock_scan(struct addrspace *only, int keep)
+{
+    int spl;
+    int i;
+    int victim;
+    int oldest = -1;
+    u_int32_t age, oldest_age = 0;
+    struct addrspace *owner;
+    
+    lock_acquire(coremap_lock);
+    //two sweeps are enough, all reference bits are clear after the first
+    for(i = 0; i < 2*coremap_size; i++)
+    {
+        victim = clock_hand;
+        clock_hand = (clock_hand + 1) % coremap_size;
+        
+        spl=splhigh();
+        owner = coremap[victim].as;
+        if(victim == keep || !can_replace(victim) || !IS_VALID(coremap[victim].paddr)
+           || (only != NULL && owner != only))
+        {
+            splx(spl);
+            continue;
+        }
+        
+        if(owner != NULL && IS_REFERENCED(coremap[victim].paddr))
+        {
+            coremap[victim].paddr = CLEAR_REFERENCED(coremap[victim].paddr);
+            coremap[victim].ws_vtime = owner->as_vtime;
+            pt_clear_refill(victim);
+            TLB_Invalidate(coremap[victim].paddr & PAGE_FRAME);
+            splx(spl);
+            continue;
+        }
+        
+        //still in the working set of its owner, remember the oldest such page
+        age = (owner != NULL) ? owner->as_vtime - coremap[victim].ws_vtime : WS_WINDOW + 1;
+        if(age <= WS_WINDOW)
+        {
+            if(oldest < 0 || age > oldest_age)
+            {
+                oldest = victim;
+                oldest_age = age;
+            }
+            splx(spl);
+            continue;
+        }
+        
+        coremap[victim].paddr = SET_BUSY(coremap[victim].paddr);
+        splx(spl);
+        lock_release(coremap_lock);
+        
+        /*Sanity check: Kernel page can't be swapped out*/
+        if(coremap[victim].vaddr > USERTOP)
+            panic("VM_WSCLOCK_PAGE_REPLACE: SWAPPING OUT KERNEL PAGE");
+        
+        return(coremap[victim].paddr);
+    }
+    
+    //every page left is in a working set, the oldest may have changed meanwhile
+    victim = -1;
+    if(oldest >= 0)
+    {
+        spl=splhigh();
+        if(can_replace(oldest) && IS_VALID(coremap[oldest].paddr)
+           && (only == NULL || coremap[oldest].as == only))
+        {
+            coremap[oldest].paddr = SET_BUSY(coremap[oldest].paddr);
+            victim = oldest;
+        }
+        splx(spl);
+    }
+    lock_release(coremap_lock);
+    
+    if(victim < 0)
+        return 0;
     
     /*Sanity check: Kernel page can't be swapped out*/
-    if(coremap[lru_page].vaddr > USERTOP)
-        panic("VM_LRU_PAGE_REPLACE: SWAPPING OUT KERNEL PAGE");
+    if(coremap[victim].vaddr > USERTOP)
+        panic("VM_WSCLOCK_PAGE_REPLACE: SWAPPING OUT KERNEL PAGE");
+    
+    return(coremap[victim].paddr);
+}
+
+/*WSClock page replacement over all the pages, see wsclock_scan()*/
+u_int32_t replace_wsclock_page(void)
+{
+    return wsclock_scan(NULL, -1);
+}
+
+/*
+ * Choose a victim page with the page replacement algorithm in use. The victim
+ * is marked busy, so nobody starts sharing it or picks it again before the 
+ * caller evicts it. Returns 0 if there is no user page which can be replaced.
+ */
+u_int32_t select_victim(void)
+{
+    switch(PAGE_REPLACEMENT_ALGO)
+    {
+        //Least recent seen page replacement algorithm
+        case LRU:
+            return replace_lru_page();
+        //Second chance page replacement algorithm
+        case CLOCK:
+            return replace_clock_page();
+        //Working set page replacement algorithm
+        case WSCLOCK:
+            return replace_wsclock_page();
+        //Random page replacement algorithm
+        case RND:
+        //By default rnd is used
+        default:
+            return replace_rnd_page();
+    }
+}
+
+/*
+ * Find a run of n contiguous empty chunks on the swap device sd (first fit).
+ * Returns the index of the first one in the bitmap of the device, or -1 if 
+ * there is no such run.
+ */
+static int swap_find_run(struct swapdev *sd, int n)
+{
+    int i;
+    int run = 0;
+    
+    if(sd->sd_free < n)
+        return -1;
+    for(i = 0; i < sd->sd_size; i++)
+    {
+        if(bitmap_isset(sd->sd_map, i))
+            run = 0;
+        else if(++run == n)
+            return i-n+1;
+    }
+    return -1;
+}
+
+/*
+ * Get a run of n contiguous empty chunks from the swap area and store the 
+ * address of the first one in chunk. The run is taken from the device of the
+ * highest priority which has one, the next one after the last device used 
+ * among those of the same priority. Returns 0 on success, or ENOSPC if there
+ * is no such run. The scan holds swapmap_lock with interrupts enabled. Only 
+ * we allocate chunks, everybody else only frees them, so a run found free is
+ * still free when it is marked.
+ */
+int get_empty_chunks(int n, u_int32_t *chunk)
+{
+    int spl;
+    int i, j, d;
+    int best = -1, first = -1;
+    
+    lock_acquire(swapmap_lock);
+    for(i = 1; i <= nswapdevs; i++)
+    {
+        d = (swap_rotor + i) % nswapdevs;
+        if(best >= 0 && swapdevs[d].sd_prio <= swapdevs[best].sd_prio)
+            continue;
+        j = swap_find_run(&swapdevs[d], n);
+        if(j >= 0)
+        {
+            best = d;
+            first = j;
+        }
+    }
+    if(best < 0)
+    {
+        lock_release(swapmap_lock);
+        return ENOSPC;
+    }
+    
+    spl=splhigh();
+    for(j = first; j < first + n; j++)
+        bitmap_mark(swapdevs[best].sd_map, j);
+    swapdevs[best].sd_free -= n;
+    swaparea_free -= n;
+    splx(spl);
+    swap_rotor = best;
+    lock_release(swapmap_lock);
+    *chunk = (swapdevs[best].sd_base + first)*PAGE_SIZE;
+    return 0;
+}
+
+/*
+ * Start evicting the user page held by the frame paddr. If the page was 
+ * swapped in and never written since then its chunk still holds the same 
+ * data, so we only point the page table entry of the owner back to the chunk.
+ * Returns 1 if the page is evicted, 0 if it still has to be written out.
+ */
+static int evict_clean_page(u_int32_t paddr)
+{
+    int spl=splhigh();
+    int page_index = ((paddr & PAGE_FRAME)-coremap_base) / PAGE_SIZE;
+    
+    /*
+     * Keep the frame busy until the caller reuses or frees it, so it can't be
+     * chosen for replacement again while we sleep on the write or the caller
+     * sleeps before mapping it.
+     */
+    coremap[ page_index ].paddr = SET_BUSY(coremap[ page_index ].paddr);
+    
+    //a text page is read again from the executable, so just unmap it
+    if(IS_TEXT(coremap[ page_index ].paddr))
+    {
+        text_uncache(page_index);
+        if(coremap[ page_index ].as != NULL)
+        {
+            u_int32_t *pte = pt_lookup(coremap[ page_index ].as, coremap[ page_index ].vaddr, 0);
+            if(pte != NULL && IS_VALID(*pte) && (*pte & PAGE_FRAME) == (paddr & PAGE_FRAME))
+                *pte = 0;
+            frame_set_owner(page_index, NULL);
+        }
+        TLB_Invalidate(paddr & PAGE_FRAME);
+        splx(spl);
+        return 1;
+    }
+    
+    if(ISSWAPPED(coremap[ page_index ].paddr) && coremap[ page_index ].status == PAGE_CLEAN)
+    {
+        add_spage(coremap[ page_index ].vaddr, coremap[ page_index ].chunk, coremap[ page_index ].as);
+        TLB_Invalidate(paddr & PAGE_FRAME);
+        //the chunk belongs to the page table entry again, not to the frame
+        coremap[ page_index ].paddr = CLEAR_SWAPPED(coremap[ page_index ].paddr);
+        coremap[ page_index ].chunk = 0;
+        splx(spl);
+        return 1;
+    }
+    splx(spl);
+    return 0;
+}
+
+/*
+ * Write the page held by the frame paddr at offset of the mapped file v, 
+ * which had filesz bytes when it was mapped.
+ */
+static int mmap_write_page(struct vnode *v, off_t offset, off_t filesz, u_int32_t paddr)
+{
+    struct uio file_uio;
+    size_t len;
+    int result;
+    
+    //the mapping doesn't extend the file
+    if(offset >= filesz)
+        return 0;
+    len = filesz - offset;
+    if(len > PAGE_SIZE)
+        len = PAGE_SIZE;
+    
+    mk_kuio(&file_uio, (void *)PADDR_TO_KVADDR(paddr & PAGE_FRAME), len, offset, UIO_WRITE);
+    result = VOP_WRITE(v, &file_uio);
+    if(result == 0 && file_uio.uio_resid != 0)
+        result = EIO;
+    return result;
+}
+
+/*
+ * Evict the page of a MAP_SHARED mapping held by the frame paddr. The page is
+ * written back to its file if dirty, instead of going to swap, and unmapped,
+ * so the next fault reads it from the file again. Returns 1 if the page is 
+ * evicted, 0 if the frame doesn't hold such a page or the write failed, then
+ * the page is swapped out as an anonymous page instead.
+ */
+static int evict_mapped_page(u_int32_t paddr)
+{
+    struct mmap_region *mr;
+    u_int32_t *pte;
+    struct vnode *v;
+    off_t offset;
+    int result;
+    
+    int spl=splhigh();
+    int page_index = ((paddr & PAGE_FRAME)-coremap_base) / PAGE_SIZE;
+    if(!IS_MAPPED(coremap[ page_index ].paddr))
+    {
+        splx(spl);
+        return 0;
+    }
+    
+    //keep the frame busy, as in evict_clean_page()
+    coremap[ page_index ].paddr = SET_BUSY(coremap[ page_index ].paddr);
+    
+    //nobody maps the page any more, it was written back by the unmap
+    if(coremap[ page_index ].as == NULL)
+    {
+        TLB_Invalidate(paddr & PAGE_FRAME);
+        thread_wakeup(&coremap[ page_index ]);
+        splx(spl);
+        return 1;
+    }
+    
+    //the mapping stays while the frame is busy, see mmap_sync()
+    mr = as_find_mmap(coremap[ page_index ].as, coremap[ page_index ].vaddr);
+    pte = pt_lookup(coremap[ page_index ].as, coremap[ page_index ].vaddr, 0);
+    assert(mr != NULL && pte != NULL);
+    v = mr->mr_file;
+    offset = mr->mr_offset + (coremap[ page_index ].vaddr - mr->mr_vaddr);
+    
+    /*
+     * Write protect the page while we write it back, so a write to it in the
+     * meantime marks it dirty again (see mark_page_dirty()) and it is written
+     * once more.
+     */
+    while(coremap[ page_index ].status == PAGE_DIRTY)
+    {
+        coremap[ page_index ].status = PAGE_CLEAN;
+        coremap[ page_index ].paddr = CLEAR_DIRTY(coremap[ page_index ].paddr);
+        *pte = CLEAR_DIRTY(*pte);
+        TLB_Invalidate(paddr & PAGE_FRAME);
+        splx(spl);
+        
+        result = mmap_write_page(v, offset, mr->mr_filesz, paddr);
+        
+        spl=splhigh();
+        if(result)
+        {
+            kprintf("VM: failed to write back page 0x%x of a mapped file\n", coremap[ page_index ].vaddr);
+            coremap[ page_index ].paddr = SET_DIRTY(CLEAR_MAPPED(coremap[ page_index ].paddr));
+            coremap[ page_index ].status = PAGE_DIRTY;
+            *pte = SET_DIRTY(*pte);
+            thread_wakeup(&coremap[ page_index ]);
+            splx(spl);
+            return 0;
+        }
+    }
+    
+    *pte = 0;
+    frame_set_owner(page_index, NULL);
+    TLB_Invalidate(paddr & PAGE_FRAME);
+    thread_wakeup(&coremap[ page_index ]);
+    splx(spl);
+    return 1;
+}
+
+/*
+ * Evict the n user pages held by the frames in paddrs. The pages of shared 
+ * file mappings go back to their file. Clean pages are dropped as in
+ * evict_page(). The dirty ones are written out SWAP_CLUSTER 
+ * at a time into runs of contiguous chunks, each run with a single write, 
+ * or one by one if the swap area has no such run. A dirty page which finds no
+ * free chunk at all stays resident: it is no longer busy and its entry in 
+ * paddrs is cleared, so the caller doesn't free its frame. Returns the number
+ * of such pages.
+ */
+int evict_pages(u_int32_t *paddrs, int n)
+{
+    u_int32_t dirty[SWAP_CLUSTER];
+    int dirty_index[SWAP_CLUSTER];
+    u_int32_t chunk;
+    int ndirty = 0;
+    int nleft = 0;
+    int i, j;
+    
+    for(i = 0; i < n; i++)
+    {
+        if(!evict_mapped_page(paddrs[i]) && !evict_clean_page(paddrs[i]))
+        {
+            dirty_index[ndirty] = i;
+            dirty[ndirty++] = paddrs[i] & PAGE_FRAME;
+        }
+        
+        //the cluster is full or this is the last page, write it out
+        if(ndirty == SWAP_CLUSTER || (ndirty > 0 && i == n-1))
+        {
+            if(ndirty > 1 && get_empty_chunks(ndirty, &chunk) == 0)
+            {
+                swapout_cluster(chunk, dirty, ndirty);
+            }
+            else
+            {
+                for(j = 0; j < ndirty; j++)
+                {
+                    if(get_empty_chunks(1, &chunk) == 0)
+                    {
+                        swapout(chunk, dirty[j]);
+                        continue;
+                    }
+                    //the swap area is full, keep the page
+                    int spl=splhigh();
+                    int page_index = (dirty[j] - coremap_base) / PAGE_SIZE;
+                    coremap[page_index].paddr = CLEAR_BUSY(coremap[page_index].paddr);
+                    thread_wakeup(&coremap[page_index]);
+                    splx(spl);
+                    paddrs[dirty_index[j]] = 0;
+                    nleft++;
+                }
+            }
+            ndirty = 0;
+        }
+    }
+    return nleft;
+}
 
-    return(coremap[lru_page].paddr);
+/*
+ * Evict the user page held by the frame paddr. If the page was swapped in and
+ * never written since then its chunk still holds the same data, so we only 
+ * point the page table entry of the owner back to the chunk and skip the 
+ * write. Otherwise write the page out into a new chunk. Returns ENOSPC if the
+ * swap area is full, then the page stays resident (see evict_pages()).
+ */
+int evict_page(u_int32_t paddr)
+{
+    return evict_pages(&paddr, 1) ? ENOSPC : 0;
 }
 
 /*
- * Get an empty chunk from the swap area to store a swapped out page 
- * We use a bitmap to describe the swap area. So, just look get an unmarked 
- * bit index from the swap_memmap and return the address of the chunk indexed 
- * by the index found. If there is no empty chunk then we are in great trouble.
- * We can't handle this request, so kill the thread and exit.
+ * Take a free frame from the coremap without evicting anything. The frame is 
+ * held until the caller maps it, as in snatch_a_page(). Returns 0 if there is
+ * no free frame.
  */
-u_int32_t get_empty_chunk() 
+static u_int32_t get_free_frame()
 {
     int spl=splhigh();
+    int free_page_index;
+    u_int32_t paddr;
     
-    unsigned chunk_index;
-    int no_free_chunk = bitmap_alloc(swap_memmap, &chunk_index);
-    
-    if(!no_free_chunk)
-    {
-        splx(spl);
-        return (chunk_index*PAGE_SIZE);
-    }    
-    else
+    free_page_index = buddy_alloc(0);
+    if(free_page_index < 0)
     {
+        //the zeroed frames are free frames too
+        paddr = zero_pool_count > 0 ? zero_pool[--zero_pool_count] : 0;
         splx(spl);
-        kprintf("VM: Swap Space full, killing curthread");
-        sys__exit(0);
-    }    
+        return paddr;
+    }
+    
+    paddr = coremap[free_page_index].paddr;
+    //the frame is busy until the caller maps it (see evict_page())
+    coremap[free_page_index].paddr = SET_BUSY(paddr);
+    splx(spl);
+    return paddr;
 }
 
 /*
  * This method is a vital method for our VM which is responsible to get a 
  * free page from the page table. If no free page is found then snatch a page.
  * The victim page can be selected according to different algorithm. We have
- * implemented two such plage replacement algorithm: Random and LRU. The 
+ * implemented three such plage replacement algorithm: Random, LRU and CLOCK. The 
  * snatched out page should be swapped out into disk. Return the page address.
  */
 u_int32_t snatch_a_page() 
 {
     int spl=splhigh();
-    unsigned free_page_index;
-    //get a free page index by looking into the memory map of the coremap
-    int free_page_not_found = bitmap_alloc(core_memmap, &free_page_index);
+    u_int32_t paddr;
+    int tries;
+    
+    //the free frames run low, let the pageout daemon refill them
+    if(pageout_running && coremap_free < PAGEOUT_LOW)
+        thread_wakeup(&pageout_chan);
+    splx(spl);
+    
+    //get a free page by looking into the memory map of the coremap
+    paddr = get_free_frame();
         
     //A free entry is found
-    if(!free_page_not_found)
+    if(paddr != 0)
+    {
+        return paddr;
+    }        
+    
+    //There is no free page available, so replace a victim page. With a full
+    //swap area only a clean victim can go, so try a few.
+    for(tries = 0; tries < SWAP_CLUSTER; tries++)
     {
-        paddr_t paddr = coremap[free_page_index].paddr;
-        //if( IS_VALID(paddr)) 
-        //{
+        //The victim comes back busy, so nobody starts sharing it before 
+        //evict_page() unmaps it (pt_share() waits for it).
+        paddr = select_victim();
+        if(paddr == 0)
+            panic("VM: no user page to replace");
+        
+        //Nobody maps the victim any more, nobody can fault the page back 
+        //in, so there is nothing to write out.
+        spl=splhigh();
+        int page_index = ((paddr & PAGE_FRAME)-coremap_base)/PAGE_SIZE;
+        if(coremap[page_index].refcount == 0)
+        {
             splx(spl);
             return paddr;
-        //}        
-        //panic("VM: Invalid Memory");
-    }        
+        }
+        splx(spl);
+        
+        //Now, we have to actually swap out the old page to make the slot free
+        //for the calling thread.
+        
+        //kprintf("swapout 0x%x\n", paddr);
+        //now, swapout the replaced page, if not dirty then skip writing
+        //to the disk. evict_page will handle this
+        if(evict_page(paddr) == 0)
+            return paddr;
+    }
+    
+    /*
+     * Out of memory and swap. The caller may hold locks or be half way 
+     * through, so it fails the allocation (kmalloc() returns NULL, a fault 
+     * fails with ENOMEM) and backs out.
+     */
+    return 0;
+}
+
+/*
+ * Same as snatch_a_page(), for a frame which must be zero filled: a frame 
+ * zeroed in idle time is taken if there is one, otherwise the frame is 
+ * zeroed here.
+ */
+static u_int32_t snatch_a_zeroed_page()
+{
+    u_int32_t paddr = 0;
+    
+    int spl=splhigh();
+    if(zero_pool_count > 0)
+    {
+        paddr = zero_pool[--zero_pool_count];
+        zero_pool_hits++;
+    }
     else
+        zero_pool_misses++;
+    splx(spl);
+    if(paddr != 0)
+        return paddr;
+    
+    paddr = snatch_a_page();
+    if(paddr != 0)
+        bzero((void *)PADDR_TO_KVADDR(paddr & PAGE_FRAME), PAGE_SIZE);
+    return paddr;
+}
+
+/*
+ * Give the frames of the zeroed frame pool back to the buddy allocator, so 
+ * they can merge into a bigger free block.
+ */
+static void zero_pool_drain()
+{
+    int spl=splhigh();
+    while(zero_pool_count > 0)
     {
-        //There is no free page available, so replace a victim page    
-        u_int32_t paddr;
-        
-        switch(PAGE_REPLACEMENT_ALGO)
+        u_int32_t paddr = zero_pool[--zero_pool_count] & PAGE_FRAME;
+        int page_index = (paddr - coremap_base) / PAGE_SIZE;
+        coremap[page_index].paddr = paddr;
+        buddy_free(page_index);
+    }
+    splx(spl);
+}
+
+/*
+ * Called by the scheduler, with interrupts off, while no thread is ready to 
+ * run: zero a free frame into the zeroed frame pool. Returns 1 if a frame was
+ * zeroed, so the scheduler lets the pending interrupts in before the next 
+ * one, or 0 if the pool is full or the free frames are short.
+ */
+int vm_zero_idle(void)
+{
+    int page_index;
+    u_int32_t paddr;
+    
+    assert(curspl > 0);
+    if(!pageout_running || zero_pool_count == ZERO_POOL || 
+       coremap_free <= PAGEOUT_HIGH)
+        return 0;
+    
+    page_index = buddy_alloc(0);
+    if(page_index < 0)
+        return 0;
+    //held busy as the frames of get_free_frame(), nobody replaces it
+    paddr = coremap[page_index].paddr & PAGE_FRAME;
+    coremap[page_index].paddr = SET_BUSY(paddr);
+    bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+    zero_pool[zero_pool_count++] = paddr;
+    return 1;
+}
+
+/*
+ * The pageout daemon. It sleeps until the free frames fall below PAGEOUT_LOW
+ * and then evicts pages, chosen by the page replacement algorithm in use, 
+ * until PAGEOUT_HIGH frames are free. The dirty pages are written out here, 
+ * so a faulting thread normally takes a free frame and only waits for its 
+ * own swap-in.
+ */
+void pageout_daemon(void *unused1, unsigned long unused2)
+{
+    u_int32_t paddr;
+    u_int32_t victims[SWAP_CLUSTER];
+    int page_index;
+    int i, n, nchunks, result;
+    
+    (void)unused1;
+    (void)unused2;
+    
+    int spl;
+    while(1)
+    {
+        while(coremap_free < PAGEOUT_HIGH)
         {
-            //Least recent seen page replacement algorithm
-            case LRU:
+            //gather a cluster of victims, so their writes go out together.
+            //select_victim() marks them busy, so they are not selected again
+            n = 0;
+            nchunks = 0;
+            while(n < SWAP_CLUSTER && coremap_free + n < PAGEOUT_HIGH)
             {
-                paddr= replace_lru_page();
-                break;
+                paddr = select_victim();
+                if(paddr == 0)
+                    break;
+                
+                spl=splhigh();
+                page_index = ((paddr & PAGE_FRAME)-coremap_base)/PAGE_SIZE;
+                //nobody maps it, nothing to write
+                if(coremap[page_index].refcount == 0)
+                {
+                    remove_ppage(paddr);
+                    splx(spl);
+                    continue;
+                }
+                //a dirty page needs a chunk, don't kill ourselves on a full swap
+                if(!(ISSWAPPED(coremap[page_index].paddr) && coremap[page_index].status == PAGE_CLEAN))
+                {
+                    if(nchunks == swaparea_free)
+                    {
+                        coremap[page_index].paddr = CLEAR_BUSY(coremap[page_index].paddr);
+                        thread_wakeup(&coremap[page_index]);
+                        splx(spl);
+                        break;
+                    }
+                    nchunks++;
+                }
+                splx(spl);
+                
+                victims[n++] = paddr & PAGE_FRAME;
             }
-            //Random page replacement algorithm
-            case RND:
-            {
-                paddr= replace_rnd_page();
+            
+            //nothing left to evict, wait for the next wakeup
+            if(n == 0)
                 break;
-            }
-            //By default rnd is used
-            default:
-                paddr= replace_rnd_page();
-        }                        
-        
-	assert(paddr!=0x0);
-        //Now, we have to actually swap out the old page to make the slot free
-        //for the calling thread. There might be a possibility of race 
-        //condition here (Ignore for mow, we'll come back to it later)
-        if(IS_VALID(paddr)) 
-        {
-            splx(spl);
             
-            //kprintf("swapout 0x%x\n", paddr);
-            //get an empty chunk to swapout the replaced page
-            u_int32_t chunk = get_empty_chunk();
-            //now, swapout the replaced page, if not dirty then skip writing
-            //to the disk. swapout will handle this
-            swapout(chunk, paddr);            
-            //TODO: Update no of asynchronous page write statistics (increment)
-     	    total_asyncpage_write++;
-            return paddr;
+            //the swap area filled up meanwhile, back off until the next 
+            //wakeup, the pages left are resident and not busy any more
+            result = evict_pages(victims, n);
+            for(i = 0; i < n; i++)
+                if(victims[i] != 0)
+                    remove_ppage(victims[i]);
+            if(result > 0)
+                break;
         }
-        panic("VM: LRU ERROR");
-    }            
+        
+        spl=splhigh();
+        thread_sleep(&pageout_chan);
+        splx(spl);
+    }
 }
 
 
@@ -587,41 +2511,30 @@ u_int32_t snatch_a_page()
  * trouble. So, panic if the page is not found in disk as page is supposed to 
  * be present either in disk or in memory. 
  */
-u_int32_t get_spage(u_int32_t vaddr, pid_t pid)
+u_int32_t get_spage(u_int32_t vaddr, struct addrspace *as)
 {
-    int i;    
+    u_int32_t *pte;
     
     /*
-     * search for the page in the disk (swaparea), if exists then return chunk 
-     * offset otherwise we are in trouble. The page was supposed to be there.
-     * So panic if the page is not in disk either.
-     * 
+     * The page table entry of a swapped out page holds the chunk of the page
+     * in the disk (swaparea). If it doesn't then we are in trouble. The page 
+     * was supposed to be there. So panic if the page is not in disk either.
      */
-        int spl=splhigh();
-        DEBUG(DB_VM, "Looking for page in swaparea...\n");
-	DEBUG(DB_VM, "pid = %d.\n", pid);
-	DEBUG(DB_VM, "curthread->pid = %d.\n", curthread->pid);
-	
-	for(i=0; i < (int)swaparea_size; i++) 
-        {
+    int spl=splhigh();
+    pte = pt_lookup(as, vaddr, 0);
+    if(pte != NULL && ISSWAPPED(*pte))
+    {
+        u_int32_t chunk = *pte & PAGE_FRAME;
+        int chunk_index = chunk / PAGE_SIZE;
         
-		//sigh! I found the page on the disk. 
-        //if(swaparea[i].vaddr == vaddr && (swaparea[i].pid == curthread->pid || swaparea[i].pid == curthread->t_vmspace->pid))
-		if(swaparea[i].vaddr == vaddr && swaparea[i].pid == pid)
-        {            
-			DEBUG(DB_VM, "matched swap #%d with vaddr 0x%x and pid %d for search vaddr 0x%x and pid %d\n", i, swaparea[i].vaddr, swaparea[i].pid, vaddr, pid);
-            splx(spl);
-            //TODO: Update asynchronous write statistics 
-	    //total_asyncpage_write++;           
-            return(swaparea[i].paddr);
-        }
-        //But wait! address space matches but pid doesn't match! panic.
-        if(swaparea[i].vaddr == vaddr) 
-        {
-            DEBUG(DB_VM, "Found matching vaddr 0x%x but doesn't match pid %d.\n", swaparea[i].vaddr, swaparea[i].pid);
-			//splx(spl);
-            //panic("VM_SPAGE: address space matches but pid doesn't match. 0x%x\n 0x%x %d %d \n",vaddr,swaparea[i].paddr,swaparea[i].pid,curthread->pid);
-        }
+        assert(chunk_index < swaparea_size);
+        assert(swaparea[ chunk_index ].vaddr == vaddr);
+        //a shared chunk may be owned by another sharer
+        assert(swaparea[ chunk_index ].as == as || swaparea[ chunk_index ].refcount > 1
+               || swaparea[ chunk_index ].as == NULL);
+        DEBUG(DB_VM, "matched swap #%d with vaddr 0x%x and pid %d\n", chunk_index, vaddr, as->pid);
+        splx(spl);
+        return chunk;
     }
     splx(spl);
     //oh damn! page doesn;t exists in disk either. Panic. We may investigate 
@@ -631,46 +2544,501 @@ u_int32_t get_spage(u_int32_t vaddr, pid_t pid)
     return 0;
 }
 
+/*
+ * Can the page at vaddr of as be read in ahead of its fault from chunk? It 
+ * must be swapped out into exactly that chunk, not shared with anyone and not
+ * being written out.
+ */
+static int can_read_around(struct addrspace *as, u_int32_t vaddr, u_int32_t chunk)
+{
+    int chunk_index = (chunk & PAGE_FRAME)/PAGE_SIZE;
+    u_int32_t *pte;
+    
+    if(vaddr >= USERTOP || chunk_index >= swaparea_size)
+        return 0;
+    pte = pt_lookup(as, vaddr, 0);
+    if(pte == NULL || !ISSWAPPED(*pte) || (*pte & PAGE_FRAME) != chunk)
+        return 0;
+    return (swaparea[ chunk_index ].refcount == 1 && swaparea[ chunk_index ].status != PAGE_IO);
+}
+
 /*
  * Bring back the page from disk into memory by swapping out a victim page if
- * necessary
+ * necessary. The neighbouring pages which were swapped out into the 
+ * neighbouring chunks are read in with it, if there are free frames to spare
+ * (read-around). They are mapped clean and unreferenced, so an unused one is 
+ * the first to go.
  */
-u_int32_t load_page_into_memory(u_int32_t vaddr, pid_t pid) 
+u_int32_t load_page_into_memory(u_int32_t vaddr, struct addrspace *as) 
 {
     //panic("VM: hm......right...\n);
     //Get the chunk containing demanded page (not in memory) from disk
-    u_int32_t chunk = get_spage(vaddr, pid);
+    u_int32_t chunk = get_spage(vaddr, as);
+    //the page was swapped out, so its page table entry exists
+    u_int32_t *pte = pt_lookup(as, vaddr, 0);
+    assert(pte != NULL);
     
     /*
      * snatch a entry in page table for this page by swapping out a victim page 
      * if necessary
      */    
     u_int32_t paddr = snatch_a_page();
-    assert(paddr!=0x0);
+    if(paddr == 0)
+    {
+        as->as_fault_error = ENOMEM;
+        return 0;
+    }
+    
+    /*
+     * Find how far the run of neighbouring pages in neighbouring chunks 
+     * goes on each side, without eating into the free frames the pageout 
+     * daemon keeps for faults.
+     */
+    u_int32_t frames[SWAP_CLUSTER];
+    int before = 0, after = 0;
+    int i, n;
+    //the run is read from one device
+    struct swapdev *sd = swap_dev(chunk);
+    int spl=splhigh();
+    while(before < SWAP_READAROUND && coremap_free - (before+after) > PAGEOUT_LOW
+          && vaddr >= (u_int32_t)(before+1)*PAGE_SIZE && chunk >= (u_int32_t)(before+1)*PAGE_SIZE
+          && swap_dev(chunk - (before+1)*PAGE_SIZE) == sd
+          && can_read_around(as, vaddr - (before+1)*PAGE_SIZE, chunk - (before+1)*PAGE_SIZE))
+        before++;
+    while(after < SWAP_READAROUND && coremap_free - (before+after) > PAGEOUT_LOW
+          && swap_dev(chunk + (after+1)*PAGE_SIZE) == sd
+          && can_read_around(as, vaddr + (after+1)*PAGE_SIZE, chunk + (after+1)*PAGE_SIZE))
+        after++;
+    n = before + 1 + after;
+    for(i = 0; i < n; i++)
+    {
+        frames[i] = (i == before) ? paddr : get_free_frame();
+        assert(frames[i] != 0);
+    }
+    splx(spl);
     
     /*
      * Now, we have a free entry in the page table for this page. So bring 
      * back the page from disk by swapping the chunk into paddr.
      */    
-    swapin(paddr, chunk);
+    if(n == 1)
+        swapin(paddr, chunk);
+    else
+        swapin_cluster(chunk - before*PAGE_SIZE, frames, n);
+    VMSTAT_ADD(as, vc_swapins, n);
     
     /*
      * set the attributes
      */
     paddr = SET_VALID(paddr);    
-    paddr = SET_SWAPPED(paddr);
     
     /*
-     * So, we have swapped in the page into memory. Add the pagetable entry for
-     * this page.
+     * So, we have swapped in the page into memory. Add the coremap entry for
+     * this page and map it back in the page table. The page is clean and the 
+     * chunk is kept as its swap cache, so it is mapped read-only to catch the 
+     * first write. The pages read around it are mapped the same way.
      */    
+    spl=splhigh();
+    for(i = 0; i < n; i++)
+    {
+        u_int32_t nvaddr = vaddr + (i-before)*PAGE_SIZE;
+        u_int32_t nchunk = chunk + (i-before)*PAGE_SIZE;
+        if(i == before)
+            continue;
+        //the page changed while we were reading, drop our copy
+        if(!can_read_around(as, nvaddr, nchunk))
+        {
+            remove_ppage(frames[i]);
+            continue;
+        }
+        add_ppage(nvaddr, SET_VALID(frames[i]), as, PAGE_CLEAN);
+        int page_index = ((frames[i] & PAGE_FRAME)-coremap_base) / PAGE_SIZE;
+        coremap[ page_index ].paddr = CLEAR_REFERENCED(SET_SWAPPED(coremap[ page_index ].paddr));
+        coremap[ page_index ].chunk = nchunk;
+        swaparea[ (nchunk & PAGE_FRAME)/PAGE_SIZE ].as = as;
+        *pt_lookup(as, nvaddr, 0) = (frames[i] & PAGE_FRAME) | SET_VALID(0);
+    }
+    
+    int chunk_index = (chunk & PAGE_FRAME)/PAGE_SIZE;
+    assert(chunk_index < swaparea_size);
+    if(swaparea[ chunk_index ].refcount > 1)
+    {
+        /*
+         * The chunk is still shared copy-on-write with other address spaces,
+         * so it can't be our swap cache. The page is private to us now.
+         */
+        swaparea[ chunk_index ].refcount--;
+        if(swaparea[ chunk_index ].as == as)
+            swaparea[ chunk_index ].as = NULL;
+        add_ppage(vaddr, paddr, as, PAGE_DIRTY);
+        *pte = (paddr & PAGE_FRAME) | SET_VALID(0) | SET_DIRTY(0);
+    }
+    else
+    {
+        add_ppage(vaddr, paddr, as, PAGE_CLEAN);
+        int page_index = ((paddr & PAGE_FRAME)-coremap_base) / PAGE_SIZE;
+        coremap[ page_index ].paddr = SET_SWAPPED(coremap[ page_index ].paddr);
+        coremap[ page_index ].chunk = chunk;
+        //we may be the last sharer of the chunk
+        swaparea[ chunk_index ].as = as;
+        *pte = (paddr & PAGE_FRAME) | SET_VALID(0);
+    }
+    paddr = *pte;
+    splx(spl);
+    
+    return paddr;	
+}
+
+/*
+ * Map the zero page read-only at vaddr in as.
+ */
+static u_int32_t map_zero_page(struct addrspace *as, u_int32_t vaddr)
+{
+    u_int32_t *pte;
+    
+    pte = pt_lookup(as, vaddr, 1);
+    if(pte == NULL)
+        return 0;
+    
     int spl=splhigh();
-    assert((chunk & PAGE_FRAME)/PAGE_SIZE < swaparea_size);
-    //add_ppage(vaddr, paddr, swaparea[(chunk & PAGE_FRAME)/PAGE_SIZE].pid, PAGE_CLEAN);
-	add_ppage(vaddr, paddr, pid, PAGE_CLEAN); //Changed by tocurtis
+    if(*pte == 0)
+    {
+        coremap[ (zero_page - coremap_base)/PAGE_SIZE ].refcount++;
+        *pte = zero_page | SET_VALID(0);
+    }
+    u_int32_t paddr = *pte;
+    splx(spl);
+    
+    return paddr;
+}
+
+/*
+ * Map a new zero filled page at vaddr in as, for the heap and stack pages 
+ * which are materialized on their first touch. A read maps the zero page, 
+ * only a write needs a frame of its own.
+ */
+u_int32_t zero_fill_page(struct addrspace *as, u_int32_t vaddr, int write)
+{
+    u_int32_t paddr;
+    
+    VMSTAT_ADD(as, vc_page_faults, 1);
+    VMSTAT_ADD(as, vc_zero_fills, 1);
+    
+    if(!write)
+        return map_zero_page(as, vaddr);
+    
+    paddr = alloc_zeroed_page(vaddr, as);
+    if(paddr == 0)
+        return 0;
+    
+    return (paddr & PAGE_FRAME) | SET_VALID(0) | SET_DIRTY(0);
+}
+
+/*
+ * Bring in a page of the executable which was never touched before. The frame
+ * is zeroed and the part of the page backed by the file is read into it (the
+ * rest is bss), then the page is mapped. A read of a page which is all bss 
+ * maps the zero page instead. A page of a read-only text region is looked up
+ * in the text cache first, and put there once read, so the address spaces 
+ * running the same executable share its frame. Returns 0 if vaddr is not in
+ * a file backed region of as.
+ */
+u_int32_t load_page_from_file(struct addrspace *as, u_int32_t vaddr, int write)
+{
+    struct region_file *rf;
+    struct text_page *tp = NULL;
+    u_int32_t *pte;
+    u_int32_t paddr;
+    vaddr_t start, end;
+    int spl;
+    
+    if(as->as_file == NULL)
+        return 0;
+    
+    if(vaddr >= as->as_vbase1 && vaddr < as->as_vbase1 + as->as_npages1*PAGE_SIZE)
+        rf = &as->as_file1;
+    else if(vaddr >= as->as_vbase2 && vaddr < as->as_vbase2 + as->as_npages2*PAGE_SIZE)
+        rf = &as->as_file2;
+    else
+        return 0;
+    
+    //get the page table entry first, creating the leaf table may need a frame
+    pte = pt_lookup(as, vaddr, 1);
+    if(pte == NULL)
+        return 0;
+    
+    VMSTAT_ADD(as, vc_page_faults, 1);
+    
+    //the part of the page present in the file
+    start = (vaddr > rf->rf_vaddr) ? vaddr : rf->rf_vaddr;
+    end = rf->rf_vaddr + rf->rf_filesz;
+    if(end > vaddr + PAGE_SIZE)
+        end = vaddr + PAGE_SIZE;
+    
+    //nothing to read, it is all bss
+    if(start >= end)
+        VMSTAT_ADD(as, vc_zero_fills, 1);
+    if(start >= end && !write)
+        return map_zero_page(as, vaddr);
+    
+    //another process running the executable may have the page already
+    if(rf->rf_shared)
+    {
+        spl=splhigh();
+        int page_index = text_lookup(as->as_file, vaddr);
+        //a frame on its way out is not shared any more
+        if(page_index >= 0 && !IS_BUSY(coremap[ page_index ].paddr))
+        {
+            coremap[ page_index ].refcount++;
+            *pte = (coremap[ page_index ].paddr & PAGE_FRAME) | SET_VALID(0);
+            paddr = *pte;
+            splx(spl);
+            return paddr;
+        }
+        splx(spl);
+        
+        //allocate the cache entry now, kmalloc may sleep
+        tp = kmalloc(sizeof(struct text_page));
+    }
+    
+    /*
+     * Hold the frame as a kernel page while we fill it, so it can't be chosen
+     * for replacement while we sleep on the read.
+     */
+    paddr = snatch_a_zeroed_page() & PAGE_FRAME;
+    if(paddr == 0)
+    {
+        as->as_fault_error = ENOMEM;
+        if(tp != NULL)
+            kfree(tp);
+        return 0;
+    }
+    add_ppage(PADDR_TO_KVADDR(paddr), paddr, NULL, PAGE_DIRTY);
+    
+    if(start < end)
+    {
+        struct uio file_uio;
+        VMSTAT_ADD(as, vc_file_reads, 1);
+        mk_kuio(&file_uio, (void *)(PADDR_TO_KVADDR(paddr) + (start - vaddr)), 
+                end - start, rf->rf_offset + (start - rf->rf_vaddr), UIO_READ);
+        int result = VOP_READ(as->as_file, &file_uio);
+        if(result || file_uio.uio_resid != 0)
+        {
+            kprintf("VM: failed to read page 0x%x of the executable\n", vaddr);
+            remove_ppage(paddr);
+            if(tp != NULL)
+                kfree(tp);
+            return 0;
+        }
+    }
+    
+    //the page now belongs to the user, map it
+    spl=splhigh();
+    if(rf->rf_shared)
+    {
+        //text is mapped read-only, a write copies it (see mark_page_dirty())
+        add_ppage(vaddr, SET_VALID(paddr), as, PAGE_CLEAN);
+        *pte = paddr | SET_VALID(0);
+        
+        //unless someone cached the page while we were reading, cache ours
+        if(tp != NULL && text_lookup(as->as_file, vaddr) < 0)
+        {
+            int page_index = (paddr - coremap_base) / PAGE_SIZE;
+            tp->tp_vnode = as->as_file;
+            tp->tp_vaddr = vaddr;
+            tp->tp_index = page_index;
+            tp->tp_next = text_hash[TEXT_HASH(vaddr)];
+            text_hash[TEXT_HASH(vaddr)] = tp;
+            coremap[ page_index ].paddr = SET_TEXT(coremap[ page_index ].paddr);
+            tp = NULL;
+        }
+    }
+    else
+    {
+        add_ppage(vaddr, SET_VALID(paddr), as, PAGE_DIRTY);
+        *pte = paddr | SET_VALID(0) | SET_DIRTY(0);
+    }
+    paddr = *pte;
+    splx(spl);
+    
+    if(tp != NULL)
+        kfree(tp);
+    
+    return paddr;
+}
+
+/*
+ * Bring in a page of a file mapped with mmap() which was never touched 
+ * before. The part of the page inside the file is read into a zeroed frame,
+ * a read of a page past the end of the file maps the zero page instead. A
+ * page of a MAP_SHARED mapping is mapped clean and read-only on a read, and
+ * marked in the coremap so that it is written back to the file instead of
+ * going to swap (see evict_mapped_page()). A page of a MAP_PRIVATE mapping is
+ * an anonymous page from now on. Returns 0 if vaddr is not in a mapping of 
+ * as, or the mapping can't be written.
+ */
+u_int32_t load_page_from_mmap(struct addrspace *as, u_int32_t vaddr, int write)
+{
+    struct mmap_region *mr;
+    struct vnode *v;
+    u_int32_t *pte;
+    u_int32_t paddr;
+    off_t offset;
+    size_t len;
+    int shared, writable;
+    int spl;
+    
+    mr = as_find_mmap(as, vaddr);
+    if(mr == NULL)
+        return 0;
+    writable = (mr->mr_prot & PROT_WRITE) != 0;
+    if(write && !writable)
+        return 0;
+    
+    //get the page table entry first, creating the leaf table may need a frame
+    pte = pt_lookup(as, vaddr, 1);
+    if(pte == NULL)
+        return 0;
+    
+    VMSTAT_ADD(as, vc_page_faults, 1);
+    
+    //the part of the page present in the file
+    offset = mr->mr_offset + (vaddr - mr->mr_vaddr);
+    len = (offset < mr->mr_filesz) ? (size_t)(mr->mr_filesz - offset) : 0;
+    if(len > PAGE_SIZE)
+        len = PAGE_SIZE;
+    
+    //nothing to read, a write copies the zero page into an anonymous page
+    if(len == 0)
+        VMSTAT_ADD(as, vc_zero_fills, 1);
+    if(len == 0 && !write)
+        return map_zero_page(as, vaddr);
+    
+    //hold the file while we sleep on the read
+    v = mr->mr_file;
+    shared = (mr->mr_flags == MAP_SHARED);
+    VOP_INCREF(v);
+    
+    //hold the frame while we fill it, as in load_page_from_file()
+    paddr = snatch_a_zeroed_page() & PAGE_FRAME;
+    if(paddr == 0)
+    {
+        as->as_fault_error = ENOMEM;
+        VOP_DECREF(v);
+        return 0;
+    }
+    add_ppage(PADDR_TO_KVADDR(paddr), paddr, NULL, PAGE_DIRTY);
+    
+    if(len > 0)
+    {
+        struct uio file_uio;
+        VMSTAT_ADD(as, vc_file_reads, 1);
+        mk_kuio(&file_uio, (void *)PADDR_TO_KVADDR(paddr), len, offset, UIO_READ);
+        //a short read leaves zeros, the file may have shrunk
+        if(VOP_READ(v, &file_uio))
+        {
+            kprintf("VM: failed to read page 0x%x of a mapped file\n", vaddr);
+            remove_ppage(paddr);
+            VOP_DECREF(v);
+            return 0;
+        }
+    }
+    
+    //the page now belongs to the user, map it
+    spl=splhigh();
+    if(shared && !write)
+    {
+        add_ppage(vaddr, SET_VALID(paddr), as, PAGE_CLEAN);
+        *pte = paddr | SET_VALID(0);
+    }
+    else
+    {
+        add_ppage(vaddr, SET_VALID(paddr), as, PAGE_DIRTY);
+        *pte = paddr | SET_VALID(0) | (writable ? SET_DIRTY(0) : 0);
+    }
+    if(shared)
+    {
+        int page_index = (paddr - coremap_base) / PAGE_SIZE;
+        coremap[ page_index ].paddr = SET_MAPPED(coremap[ page_index ].paddr);
+    }
+    paddr = *pte;
     splx(spl);
     
-    return paddr;	
+    VOP_DECREF(v);
+    return paddr;
+}
+
+/*
+ * Write back the dirty pages of the shared mapping mr of as in [start, end).
+ * A page written by us alone is marked clean and write protected, so it is 
+ * not written again until it changes. A page also mapped by a process we 
+ * forked stays dirty, as the others may still write it through their own
+ * writable entries.
+ */
+int mmap_sync(struct addrspace *as, struct mmap_region *mr, vaddr_t start, vaddr_t end)
+{
+    vaddr_t vaddr;
+    u_int32_t *pte;
+    u_int32_t paddr;
+    int page_index;
+    int result;
+    
+    for(vaddr = start; vaddr < end; vaddr += PAGE_SIZE)
+    {
+        int spl=splhigh();
+        pte = pt_lookup(as, vaddr, 0);
+        
+        //wait for an eviction or another write back of the page in flight
+        while(pte != NULL && IS_VALID(*pte))
+        {
+            page_index = ((*pte & PAGE_FRAME) - coremap_base) / PAGE_SIZE;
+            if(!IS_MAPPED(coremap[ page_index ].paddr) || !IS_BUSY(coremap[ page_index ].paddr))
+                break;
+            thread_sleep(&coremap[ page_index ]);
+        }
+        if(pte == NULL || !IS_VALID(*pte))
+        {
+            splx(spl);
+            continue;
+        }
+        
+        page_index = ((*pte & PAGE_FRAME) - coremap_base) / PAGE_SIZE;
+        if(!IS_MAPPED(coremap[ page_index ].paddr) || coremap[ page_index ].status != PAGE_DIRTY)
+        {
+            splx(spl);
+            continue;
+        }
+        
+        //keep the frame busy, so it is not evicted while we write it
+        paddr = *pte & PAGE_FRAME;
+        coremap[ page_index ].paddr = SET_BUSY(coremap[ page_index ].paddr);
+        if(coremap[ page_index ].refcount == 1)
+        {
+            coremap[ page_index ].status = PAGE_CLEAN;
+            coremap[ page_index ].paddr = CLEAR_DIRTY(coremap[ page_index ].paddr);
+            *pte = CLEAR_DIRTY(*pte);
+            TLB_Invalidate(paddr);
+        }
+        splx(spl);
+        
+        result = mmap_write_page(mr->mr_file, mr->mr_offset + (vaddr - mr->mr_vaddr), 
+                                 mr->mr_filesz, paddr);
+        
+        spl=splhigh();
+        coremap[ page_index ].paddr = CLEAR_BUSY(coremap[ page_index ].paddr);
+        if(result)
+        {
+            coremap[ page_index ].status = PAGE_DIRTY;
+            coremap[ page_index ].paddr = SET_DIRTY(coremap[ page_index ].paddr);
+        }
+        thread_wakeup(&coremap[ page_index ]);
+        splx(spl);
+        
+        if(result)
+            return result;
+    }
+    
+    return 0;
 }
 
 /* 
@@ -681,60 +3049,49 @@ u_int32_t load_page_into_memory(u_int32_t vaddr, pid_t pid)
  * page to be swapped out.
  * 
  */
-u_int32_t get_ppage(u_int32_t vaddr, pid_t pid)
+u_int32_t get_ppage(struct addrspace *as, u_int32_t vaddr)
 {
-    u_int32_t paddr;    
-    int i;
+    u_int32_t *pte;
+    u_int32_t paddr;
     
     int spl=splhigh();
     /*
-     * search for the page in the page table, if exists then return paddr 
+     * look up the page in the page table, if it is resident then return paddr
      * otherwise we need to bring the pageback into memory from disk by swapping
      * out a victim page to make place for the demanded page in memory
-     * 
      */   
-    for(i=0; i < (int)coremap_size; i++) 
-    {
-        //a match found
-        if(coremap[i].vaddr == vaddr && (coremap[i].pid == pid || coremap[i].pid == 0)) 
-        {          
-            //DEBUG(DB_VM, "Found the page!\n\n");
-			//a valid page fault
-            if(IS_VALID(coremap[i].paddr)) 
-            {             
-		    //DEBUG(DB_VM, "matched coremap #%d with vaddr 0x%x and pid %d for search vaddr 0x%x and pid %d\n", i, coremap[i].vaddr, coremap[i].pid, vaddr, pid);
-   
-                splx(spl);
-                
-				//TODO: Update the tlb fault statistics
-				if(pid == curthread->pid)
-					total_tlb_faults++;
-				else
-					total_page_faults++;
-
-                return coremap[i].paddr;
-            }
-	    else
-		panic("invalid  paddress 0x%x\n 0x%x %d %d %d\n",vaddr,coremap[i].paddr,coremap[i].pid,curthread->pid, pid);
-        }        
-        //weird! address present but pid doesn't match! where did this page came
-        //from, who allocated it? we don't know, so panic!
-        if(coremap[i].vaddr == vaddr)
-        {            
-			// The core map should have multiple identical virtual addresses separated by pid so we need to keep searching
-			//splx(spl);
-            //panic("VM_PPAGE: address present but pid doesn't match 0x%x\n 0x%x %d %d %d\n",vaddr,coremap[i].paddr,coremap[i].pid,curthread->pid, pid);
-        }
+    pte = pt_lookup(as, vaddr, 0);
+    if(pte != NULL && IS_VALID(*pte))
+    {
+        paddr = *pte;
+        
+        //the other sharers of the page are gone, so the page is ours now
+        int page_index = ((paddr & PAGE_FRAME)-coremap_base) / PAGE_SIZE;
+        if(coremap[ page_index ].refcount == 1 && coremap[ page_index ].as == NULL)
+            frame_set_owner(page_index, as);
+        splx(spl);
+        
+        //the page is resident, only the TLB entry was missing
+        VMSTAT_ADD(as, vc_tlb_faults, 1);
+        
+        return paddr;
+    }
+    
+    //the page was never mapped in this address space
+    if(pte == NULL || !ISSWAPPED(*pte))
+    {
+        splx(spl);
+        DEBUG(DB_VM, "VM: vaddr 0x%x is not mapped for pid %d\n", vaddr, as->pid);
+        return 0;
     }
     
-    //Outside of the search loop, so the page doesn't present in memory. We must
-    //bring the page from disk into memory. So, this is also a valid page fault
+    //So the page doesn't present in memory. We must bring the page from disk 
+    //into memory. So, this is also a valid page fault
     
-    //TODO: update page fault statistics
-    total_page_faults++;
+    VMSTAT_ADD(as, vc_page_faults, 1);
     splx(spl);
 
-    DEBUG(DB_VM, "Searched for vaddr 0x%x and pid %d\n", vaddr, pid);
+    DEBUG(DB_VM, "Searched for vaddr 0x%x and pid %d\n", vaddr, as->pid);
 	DEBUG(DB_VM, "Couldn't find the page in memory.\n");
 
     /*
@@ -742,24 +3099,154 @@ u_int32_t get_ppage(u_int32_t vaddr, pid_t pid)
      * then replace a victim page to make space for this page. Return the paddr 
      * of the page
      */    
-    paddr = load_page_into_memory(vaddr, pid);    
+    paddr = load_page_into_memory(vaddr, as);    
     
     return paddr ;    
 }
 
+/*
+ * Count a fault of as which started at sec:nsec in the latency histogram, 
+ * one bucket per decade from 10us up.
+ */
+static void vmstat_fault_latency(struct addrspace *as, time_t sec, u_int32_t nsec)
+{
+    time_t now_sec;
+    u_int32_t now_nsec;
+    int usec, limit, bucket;
+    
+    gettime(&now_sec, &now_nsec);
+    usec = (now_sec - sec)*1000000 + (int)(now_nsec/1000) - (int)(nsec/1000);
+    
+    for(bucket = 0, limit = 10; bucket < VMSTAT_LAT_BUCKETS-1 && usec >= limit; bucket++, limit *= 10)
+        ;
+    VMSTAT_ADD(as, vc_fault_lat[bucket], 1);
+}
+
+/*
+ * Limit the resident set of each process of the process group pgrp to npages
+ * frames, 0 removes the limit.
+ */
+int vm_set_rss_limit(pid_t pgrp, u_int32_t npages)
+{
+    int i;
+    int free_slot = -1;
+    
+    if(npages != 0 && npages < RSS_LIMIT_MIN)
+        return EINVAL;
+    
+    int spl=splhigh();
+    for(i = 0; i < RSS_LIMITS; i++)
+    {
+        if(rss_limits[i].rl_npages != 0 && rss_limits[i].rl_pgrp == pgrp)
+        {
+            rss_limits[i].rl_npages = npages;
+            splx(spl);
+            return 0;
+        }
+        if(rss_limits[i].rl_npages == 0 && free_slot < 0)
+            free_slot = i;
+    }
+    
+    if(npages != 0)
+    {
+        if(free_slot < 0)
+        {
+            splx(spl);
+            return ENOMEM;
+        }
+        rss_limits[free_slot].rl_pgrp = pgrp;
+        rss_limits[free_slot].rl_npages = npages;
+    }
+    splx(spl);
+    return 0;
+}
+
+/*The resident set limit of the process group of as, 0 if none*/
+static u_int32_t rss_limit(struct addrspace *as)
+{
+    struct process *p;
+    int i;
+    
+    if(!pid_exists(as->pid))
+        return 0;
+    p = get_process(as->pid);
+    for(i = 0; i < RSS_LIMITS; i++)
+        if(rss_limits[i].rl_npages != 0 && rss_limits[i].rl_pgrp == p->pgrp_id)
+            return rss_limits[i].rl_npages;
+    return 0;
+}
+
+/*
+ * Evict pages of as, outside of its working set first, until its resident set
+ * is within limit again. The frame at keep, which the fault has just mapped, 
+ * stays. Gives up if no page of as can be replaced or swap is full.
+ */
+static void rss_trim(struct addrspace *as, u_int32_t limit, int keep)
+{
+    u_int32_t paddr;
+    int page_index;
+    int spl;
+    
+    while(as->as_rss > limit)
+    {
+        paddr = wsclock_scan(as, keep);
+        if(paddr == 0)
+            return;
+        
+        //a dirty page needs a chunk, don't kill ourselves on a full swap
+        spl=splhigh();
+        page_index = ((paddr & PAGE_FRAME)-coremap_base)/PAGE_SIZE;
+        if(swaparea_free == 0 && 
+           !(ISSWAPPED(coremap[page_index].paddr) && coremap[page_index].status == PAGE_CLEAN))
+        {
+            coremap[page_index].paddr = CLEAR_BUSY(coremap[page_index].paddr);
+            thread_wakeup(&coremap[page_index]);
+            splx(spl);
+            return;
+        }
+        splx(spl);
+        
+        if(evict_page(paddr) != 0)
+            return;
+        remove_ppage(paddr);
+    }
+}
+
 /* 
  * This is the interface of our vm to handle tlb/page fault() by calling the
  * get_ppage() to bring the page into memory. It is responsible for updating 
- * the last access time of the page to make our LRU page replacement working.
+ * the last access time of the page to make our LRU page replacement working,
+ * and for keeping the process within its resident set limit.
  */
-u_int32_t handle_page_fault(u_int32_t vaddr)
+u_int32_t handle_page_fault(u_int32_t vaddr, int write)
 {
     u_int32_t paddr;
+    time_t start_sec;
+    u_int32_t start_nsec;
+    
+    gettime(&start_sec, &start_nsec);
+    //the virtual time of the WSClock page replacement
+    curthread->t_vmspace->as_vtime++;
     
     //bring the page into memory if not present in memory and return the paddr
     //of this page
-    paddr = get_ppage(vaddr & PAGE_FRAME, curthread->pid);
-    assert(paddr!=0x0);
+    paddr = get_ppage(curthread->t_vmspace, vaddr & PAGE_FRAME);
+    //not mapped yet, it may be a page of the executable never touched so far
+    if(paddr == 0)
+        paddr = load_page_from_file(curthread->t_vmspace, vaddr & PAGE_FRAME, write);
+    //or a page of a file mapped with mmap()
+    if(paddr == 0)
+        paddr = load_page_from_mmap(curthread->t_vmspace, vaddr & PAGE_FRAME, write);
+    //or a heap page never touched so far
+    if(paddr == 0 && (vaddr & PAGE_FRAME) >= curthread->t_vmspace->as_heapbase
+                  && (vaddr & PAGE_FRAME) < curthread->t_vmspace->as_heaptop)
+        paddr = zero_fill_page(curthread->t_vmspace, vaddr & PAGE_FRAME, write);
+    //or the stack growing down, the guard pages below its limit stay unmapped
+    if(paddr == 0 && (vaddr & PAGE_FRAME) >= VM_STACKLIMIT 
+                  && (vaddr & PAGE_FRAME) < USERSTACK)
+        paddr = zero_fill_page(curthread->t_vmspace, vaddr & PAGE_FRAME, write);
+    if(paddr == 0)
+        return 0;
     
     /*
      * check whether the physical address is a valid 20 bit addr or not. If valid
@@ -781,173 +3268,581 @@ u_int32_t handle_page_fault(u_int32_t vaddr)
 		coremap[ page_index ].last_access_time_sec = (u_int32_t)sec;
 		coremap[ page_index ].last_access_time_nsec = (u_int32_t)nsec;
 	}
+	else if(PAGE_REPLACEMENT_ALGO == CLOCK || PAGE_REPLACEMENT_ALGO == WSCLOCK)
+	{
+		//the page faulted in again, so it has been referenced
+		int page_index = ((paddr & PAGE_FRAME)-coremap_base) / PAGE_SIZE;
+		assert(page_index>=0 && page_index<(int)coremap_size);
+		coremap[ page_index ].paddr = SET_REFERENCED(coremap[ page_index ].paddr);
+	}
         
-        return (paddr & PAGE_FRAME);
+        //the next misses on the page are refilled by the UTLB miss handler 
+        //until the page replacement clears its reference bit. LRU needs to see
+        //every miss to keep the access times.
+        if(PAGE_REPLACEMENT_ALGO != LRU)
+            pt_set_refill(curthread->t_vmspace, vaddr & PAGE_FRAME, paddr);
+        
+        //over the limit of our process group, give back pages of our own
+        u_int32_t limit = rss_limit(curthread->t_vmspace);
+        if(limit != 0 && curthread->t_vmspace->as_rss > limit)
+            rss_trim(curthread->t_vmspace, limit, ((paddr & PAGE_FRAME)-coremap_base) / PAGE_SIZE);
+        
+        vmstat_fault_latency(curthread->t_vmspace, start_sec, start_nsec);
+        
+        //keep the write enable bit, clean pages are mapped read-only
+        return (paddr & PAGE_FRAME) | IS_DIRTY(paddr);
     }
        
     panic("VM: invalid page table fault 0x%x",vaddr);
     return 0;            
 }
 
+/*
+ * Handle a write to a page which is mapped read-only. A page of a read-only 
+ * file mapping can't be written, and a page of a MAP_SHARED mapping is written
+ * in place by all the processes mapping it. If the page is shared 
+ * copy-on-write then copy it into a new frame which only we map. Otherwise 
+ * the page is clean, the copy of the page in the swap cache becomes stale, so
+ * release the chunk and mark the page dirty in the page table and in the 
+ * coremap.
+ */
+u_int32_t mark_page_dirty(u_int32_t vaddr)
+{
+    struct addrspace *as = curthread->t_vmspace;
+    u_int32_t *pte;
+    
+    if(as == NULL)
+        return 0;
+    
+    int spl=splhigh();
+    pte = pt_lookup(as, vaddr & PAGE_FRAME, 0);
+    if(pte == NULL || !IS_VALID(*pte))
+    {
+        splx(spl);
+        return 0;
+    }
+    
+    struct mmap_region *mr = as_find_mmap(as, vaddr & PAGE_FRAME);
+    if(mr != NULL && !(mr->mr_prot & PROT_WRITE))
+    {
+        splx(spl);
+        return 0;
+    }
+    
+    int page_index = ((*pte & PAGE_FRAME)-coremap_base) / PAGE_SIZE;
+    assert(page_index>=0 && page_index<(int)coremap_size);
+    //the page goes back to the file, see mmap_sync() and evict_mapped_page()
+    if(IS_MAPPED(coremap[ page_index ].paddr))
+    {
+        coremap[ page_index ].paddr = SET_REFERENCED(SET_DIRTY(coremap[ page_index ].paddr));
+        coremap[ page_index ].status = PAGE_DIRTY;
+        *pte = SET_DIRTY(*pte);
+        splx(spl);
+        return (*pte & PAGE_FRAME) | SET_DIRTY(0);
+    }
+    if(coremap[ page_index ].refcount > 1)
+    {
+        u_int32_t old_paddr = *pte & PAGE_FRAME;
+        
+        //hold an extra reference, so the shared frame can't be replaced 
+        //while we snatch a frame for the copy
+        coremap[ page_index ].refcount++;
+        splx(spl);
+        
+        //the first write to the zero page, no need to copy zeros
+        u_int32_t paddr = (old_paddr == zero_page) ? snatch_a_zeroed_page() 
+                                                   : snatch_a_page();
+        if(paddr == 0)
+        {
+            //keep the shared frame mapped, the fault fails
+            spl=splhigh();
+            coremap[ page_index ].refcount--;
+            splx(spl);
+            as->as_fault_error = ENOMEM;
+            return 0;
+        }
+        VMSTAT_ADD(as, vc_cow_copies, 1);
+        if(old_paddr != zero_page)
+            memmove((void *)PADDR_TO_KVADDR(paddr & PAGE_FRAME),
+                    (const void *)PADDR_TO_KVADDR(old_paddr), PAGE_SIZE);
+        
+        spl=splhigh();
+        add_ppage(vaddr & PAGE_FRAME, SET_VALID(paddr), as, PAGE_DIRTY);
+        *pte = (paddr & PAGE_FRAME) | SET_VALID(0) | SET_DIRTY(0);
+        coremap[ page_index ].refcount--;
+        frame_unref(page_index, as);
+        //the other sharers went away while we copied, as in pt_unmap()
+        if(coremap[ page_index ].refcount == 0 && !IS_KERNEL(coremap[ page_index ].paddr)
+           && !IS_BUSY(coremap[ page_index ].paddr))
+            remove_ppage(old_paddr);
+        splx(spl);
+        
+        return (paddr & PAGE_FRAME) | SET_DIRTY(0);
+    }
+    
+    //we are the only one mapping the page
+    if(coremap[ page_index ].as != as)
+        frame_set_owner(page_index, as);
+    //it doesn't hold the text of the executable any more
+    if(IS_TEXT(coremap[ page_index ].paddr))
+        text_uncache(page_index);
+    if(ISSWAPPED(coremap[ page_index ].paddr))
+    {
+        remove_spage(coremap[ page_index ].chunk);
+        coremap[ page_index ].chunk = 0;
+    }
+    coremap[ page_index ].paddr = SET_REFERENCED(SET_DIRTY(CLEAR_SWAPPED(coremap[ page_index ].paddr)));
+    coremap[ page_index ].status = PAGE_DIRTY;
+    *pte = SET_DIRTY(*pte);
+    splx(spl);
+    
+    return (*pte & PAGE_FRAME) | SET_DIRTY(0);
+}
+
 /*
  * alloc_page(): allocate a single page:
  * -------------------------------------
- * 1. Snatch a page from paging module by calling snatch_a_page()
+ * 1. Snatch a page from paging module by calling snatch_a_page(), or 
+ *    snatch_a_zeroed_page() if zero is set
  * 2. Insert the page into the coremap and mark the bitmap properly.
  * 3. Return the physical address of the page
  */
-u_int32_t alloc_page(u_int32_t vaddr, int pid)
+static u_int32_t alloc_page_frame(u_int32_t vaddr, struct addrspace *as, int zero)
 {
     u_int32_t paddr;
+    u_int32_t *pte;
     
     //kprintf("vm bootstrap: alloc_page\n");
     
+    //get the page table entry first, creating the leaf table may need a frame
+    pte = pt_lookup(as, vaddr, 1);
+    if(pte == NULL)
+        return 0;
+    //already mapped, don't leak a second frame for the same vaddr
+    if(*pte != 0)
+        return get_ppage(as, vaddr);
+    
     //snatch a page from paging module. Paging module is responsible for all
     //paging/swapping mechanism to allocate the page
-    paddr = snatch_a_page();
+    paddr = zero ? snatch_a_zeroed_page() : snatch_a_page();
+    if(paddr == 0)
+    {
+        as->as_fault_error = ENOMEM;
+        return 0;
+    }
     
-    //set valid attribute as snatch_a_page() guaranteed to return a valid paddr
+    //set valid attribute, snatch_a_page() returned a valid paddr
     paddr = SET_VALID(paddr);
     //check whether it is a kernel page or not, if yes then mark as kernel and
     //we'll not touch it later
     if( vaddr >= MIPS_KSEG0)
         paddr = SET_KERNEL(paddr);
     //Add the invert entry for this page mapped to vaddr into pagetable coremap
-    add_ppage(vaddr, paddr, pid, PAGE_DIRTY);
+    add_ppage(vaddr, paddr, as, PAGE_DIRTY);
+    //and the forward mapping into the page table of the address space
+    *pte = (paddr & PAGE_FRAME) | SET_VALID(0) | SET_DIRTY(0);
     
     return paddr;    
 }
 
-/* Allocate n contiguous kernel pages */
-u_int32_t kpage_nalloc(int n, int pid)
+u_int32_t alloc_page(u_int32_t vaddr, struct addrspace *as)
 {
-    u_int32_t paddr;
+    return alloc_page_frame(vaddr, as, 0);
+}
+
+/*
+ * Same as alloc_page(), but the page is zero filled before it is mapped.
+ */
+u_int32_t alloc_zeroed_page(u_int32_t vaddr, struct addrspace *as)
+{
+    return alloc_page_frame(vaddr, as, 1);
+}
 
+/*
+ * Move the user page held by the frame at src into a free frame outside of 
+ * the coremap indexes [lo, hi): copy the page, move the coremap entry with it
+ * and point the page table entry of the owner to the new frame. The page 
+ * stays resident, so there is no disk I/O. Only a frame which could be 
+ * replaced is moved, its only mapping is the one of its owner. The copy is 
+ * done with interrupts off, so nobody writes the page meanwhile. Returns 0 if
+ * src no longer holds a user page, ENOMEM if there is no free frame to move 
+ * the page to.
+ */
+static int migrate_frame(int src, int lo, int hi)
+{
+    u_int32_t *pte;
+    u_int32_t src_frame, dst_frame, flags;
+    int dst, order;
+    
     int spl=splhigh();
-    int i;
-    unsigned index=0,count=0;
-    unsigned swap_index=0,swap_count=0;
-    unsigned best_count=0,best_index=0;
+    //the frame may have changed hands meanwhile
+    if(!bitmap_isset(core_memmap, src) || !can_replace(src) || !IS_VALID(coremap[src].paddr))
+    {
+        splx(spl);
+        return 0;
+    }
+    //nobody maps the page any more, just drop it
+    if(coremap[src].refcount == 0)
+    {
+        remove_ppage(coremap[src].paddr);
+        splx(spl);
+        return 0;
+    }
+    
+    dst = buddy_alloc_outside(lo, hi);
+    if(dst < 0)
+    {
+        splx(spl);
+        return ENOMEM;
+    }
+    
+    src_frame = coremap[src].paddr & PAGE_FRAME;
+    dst_frame = coremap[dst].paddr & PAGE_FRAME;
+    flags = coremap[src].paddr & ~PAGE_FRAME;
+    pte = pt_lookup(coremap[src].as, coremap[src].vaddr, 0);
+    assert(pte != NULL && IS_VALID(*pte) && (*pte & PAGE_FRAME) == src_frame);
+    
+    memmove((void *)PADDR_TO_KVADDR(dst_frame), (const void *)PADDR_TO_KVADDR(src_frame), PAGE_SIZE);
+    
+    //the entry moves as it is, the resident set of the owner doesn't change
+    order = coremap[dst].order;
+    coremap[dst] = coremap[src];
+    coremap[dst].paddr = dst_frame | flags;
+    coremap[dst].order = order;
+    if(IS_TEXT(flags))
+        text_move(src, dst);
+    *pte = dst_frame | (*pte & ~PAGE_FRAME);
+    TLB_Invalidate(src_frame);
+    
+    //src holds nothing now, its chunk and its text page went with the page
+    coremap[src].paddr = src_frame;
+    coremap[src].as = NULL;
+    coremap[src].chunk = 0;
+    coremap[src].refcount = 0;
+    remove_ppage(src_frame);
+    total_frames_migrated++;
+    splx(spl);
+    
+    return 0;
+}
+
+/*
+ * Make a free block of 2^order frames for kpage_nalloc() out of the aligned
+ * block which holds the fewest user pages. Only blocks without kernel or 
+ * shared pages qualify. The user pages are moved out of the block while 
+ * there are free frames elsewhere (see migrate_frame()), and evicted only if 
+ * may_evict is set and there are none. The scan holds coremap_lock with
+ * interrupts enabled, each frame is checked again when it is claimed. Returns
+ * 0 if a block was emptied, ENOMEM if there is no such block or it can't be
+ * emptied without evicting.
+ */
+static int make_free_block(int order, int may_evict)
+{
+    int size = 1 << order;
+    int start, i, j, used;
+    int best_index = -1, best_used = 0;
+    u_int32_t victims[SWAP_CLUSTER];
+    int nvictims = 0;
+    int full = 0;
+    int spl;
+    
+    lock_acquire(coremap_lock);
+    for(start = 0; start + size <= coremap_size; start += size)
+    {
+        used = 0;
+        for(i = start; i < start + size; i++)
+        {
+            if(!bitmap_isset(core_memmap, i))
+                continue;
+            //We should not replace kernel or shared pages, or frames in transit
+            if(!can_replace(i) || !IS_VALID(coremap[i].paddr))
+                break;
+            used++;
+        }
+        if(i == start + size && (best_index < 0 || used < best_used))
+        {
+            best_index = start;
+            best_used = used;
+        }
+    }
+    lock_release(coremap_lock);
+    if(best_index < 0)
+        return ENOMEM;
+    
+    for(i = best_index; i < best_index + size; i++)
+    {
+        //move the page out of the block, it stays resident
+        if(migrate_frame(i, best_index, best_index + size) == 0)
+            continue;
+        if(!may_evict)
+            return ENOMEM;
+        
+        //the frame may have changed hands while we were evicting
+        spl=splhigh();
+        if(bitmap_isset(core_memmap, i) && can_replace(i) && IS_VALID(coremap[i].paddr))
+        {
+            //the page is valid but nobody maps it any more, just drop it
+            if(coremap[i].refcount == 0)
+            {
+                remove_ppage(coremap[i].paddr);
+            }
+            //the page is valid, claim it and evict it with its neighbours
+            else
+            {
+                coremap[i].paddr = SET_BUSY(coremap[i].paddr);
+                victims[nvictims++] = coremap[i].paddr & PAGE_FRAME;
+            }
+        }
+        splx(spl);
+        
+        if(nvictims == SWAP_CLUSTER)
+        {
+            //Now, swapout the pages into the disk unless they are clean, and
+            //free their frames, which merge into the block
+            //a page left resident for want of swap breaks the block
+            if(evict_pages(victims, nvictims) > 0)
+                full = 1;
+            for(j = 0; j < nvictims; j++)
+                if(victims[j] != 0)
+                    remove_ppage(victims[j]);
+            nvictims = 0;
+        }
+    }
+    
+    if(nvictims > 0)
+    {
+        if(evict_pages(victims, nvictims) > 0)
+            full = 1;
+        for(j = 0; j < nvictims; j++)
+            if(victims[j] != 0)
+                remove_ppage(victims[j]);
+    }
+    
+    return full ? ENOSPC : 0;
+}
+
+/*
+ * The compactor. Once a second, if nothing else wants to run, it makes a free
+ * block of 2^COMPACT_ORDER frames out of the user pages if there is none, by
+ * moving pages only. So a big kernel allocation finds a free block without 
+ * evicting anything. It leaves the free frames the pageout daemon keeps 
+ * alone.
+ */
+void compact_daemon(void *unused1, unsigned long unused2)
+{
+    (void)unused1;
+    (void)unused2;
+    
+    while(1)
+    {
+        clocksleep(1);
+        
+        if(!scheduler_idle() || coremap_free < COMPACT_FREE)
+            continue;
+        if(buddy_max_free_order() >= COMPACT_ORDER)
+            continue;
+        make_free_block(COMPACT_ORDER, 0);
+    }
+}
+
+/* 
+ * Allocate n contiguous kernel pages. The pages are a block of the buddy 
+ * allocator, n rounded up to a power of two. If no free block is big enough
+ * then the user pages of a block are evicted to make one.
+ */
+u_int32_t kpage_nalloc(int n)
+{
+    u_int32_t paddr;
+    int order = 0;
+    int index, tries, i;
 
-    //kprintf("vm bootstrap: cp5\n");
     //Just one page? then snatch a page and update pagetable coremap
     if(n==1) 
     {
-        u_int32_t paddr = snatch_a_page();
+        paddr = snatch_a_page();
+        if(paddr == 0)
+            return 0;
         paddr = SET_VALID(paddr);
         paddr = SET_KERNEL(paddr);
-        add_ppage( PADDR_TO_KVADDR(paddr), paddr, curthread->pid, PAGE_DIRTY);
-        splx(spl);
+        add_ppage( PADDR_TO_KVADDR(paddr), paddr, NULL, PAGE_DIRTY);
         
         return (paddr & PAGE_FRAME);
     }
 
-    /* 
-     * Otherwise, find the index of a hole from which there are at least n contagious pages. 
-     */
-    for(i = 0 ; i < (int)coremap_size; i++) 
+    while((1 << order) < n)
+        order++;
+    if(order > BUDDY_MAX_ORDER)
+        return 0;
+    
+    int spl;
+    //the block we emptied may be taken while we were evicting, so retry
+    for(tries = 0; tries < 3; tries++)
     {
-        //We should not replace kernel pages: kernel pages shouldn't be touched
-        //so look for non-kernel pages to replace and make a big enough hole
-	if(IS_KERNEL(coremap[i].paddr)) 
-	{
-            //If it is a kernel page and we didn't find a big enough hole so 
-            //far then we can't take the current hole. So get back.
-            swap_count = 0;
-	}
-	//a non-kernel page is found in the hole currently under investigation
-        else 
-        {
-	    //ok last page was kernel an so we are restarting the hole from this page
-            if( swap_count == 0) 
-                swap_index = i;
-            //keep maintaining how many contagious pages should be replaced
-            swap_count++;
-            
-            //ok, now we have n contagious nonkernel pages. So, this is a potential good hole
-            if ((int)swap_count >= n)
+        spl=splhigh();
+        index = buddy_alloc(order);
+        if(index >= 0)
+        {
+            //claim the block
+            for(i = index; i < index + (1 << order); i++)
             {
-		//update index and size of the best hole found so far
-                if(best_count > count) 
-                {
-                    best_count = count;
-                    best_index = swap_index;
-                }
-
-		//resrart the search from this page to find a better hole (if exists)
-                swap_count = 0;
+                paddr = SET_KERNEL(SET_VALID(coremap[i].paddr));
+                add_ppage(PADDR_TO_KVADDR(paddr & PAGE_FRAME), paddr, NULL, PAGE_DIRTY);
             }
+            splx(spl);
+            
+            paddr = coremap[index].paddr;
+            //kprintf("VM_ALLOCN: 0x%x\n", paddr);
+            return (paddr & PAGE_FRAME);
         }
+        splx(spl);
         
-	//if this is a free page then a free hole can be started from here, set free hole index and size
-        if( !bitmap_isset(core_memmap, i) )	       
+        //the zeroed frames may complete a free block
+        if(tries == 0 && zero_pool_count > 0)
         {
-            index = i;
-            count = 0;
+            zero_pool_drain();
+            continue;
         }
-	else
-	{
-	    //ok, we can't get this page as free page. So, lets check if we have found n free pages or nor
-	    //if we fund n pages then its the perfect free hole so far, so stop the search.
-	    if((int)count == n) 
-	    {
-		break; 
-	    }	               
-	}
+        //not enough pages to move or replace
+        if(make_free_block(order, 1))
+            break;
+    }
+    
+    return 0;
+}
 
-	count ++;
+/*
+ * Free the kernel pages allocated by kpage_nalloc() starting at paddr. The 
+ * number of pages comes from the order of the block kept in the coremap.
+ */
+void kpage_free(u_int32_t paddr)
+{
+    int page_index, i;
+    
+    //pages stolen before the coremap was set up are never freed
+    if(paddr < coremap_base)
+        return;
+    
+    int spl=splhigh();
+    page_index = ((paddr & PAGE_FRAME) - coremap_base) / PAGE_SIZE;
+    assert(bitmap_isset(core_memmap, page_index) && coremap[page_index].order >= 0);
+    assert(IS_KERNEL(coremap[page_index].paddr));
+    
+    //clear the rest of the block, remove_ppage() frees all of it
+    for(i = page_index + 1; i < page_index + (1 << coremap[page_index].order); i++)
+    {
+        coremap[i].vaddr = 0;
+        coremap[i].paddr = coremap[i].paddr & PAGE_FRAME;
+        coremap[i].pid = 0;
+        coremap[i].as = NULL;
+        coremap[i].status = PAGE_FREE;
+        coremap[i].chunk = 0;
+        coremap[i].refcount = 0;
     }
+    remove_ppage(paddr & PAGE_FRAME);
+    splx(spl);
+}
+
+
+/*
+ * Fill vs with the fault counters of as (zero if as is NULL) and of all the 
+ * address spaces, and count the frames of the coremap and the chunks of the
+ * swap area in use. The frames are counted with interrupts enabled, so the 
+ * counts are only a snapshot.
+ */
+void vmstat_get(struct addrspace *as, struct vmstat *vs)
+{
+    int i;
     
-    //so no of contagious free pages found in the search is not enough. 
-    //So, we need to replace some non-kernel pages. Start from the best 
-    //the best non-kernel hole we found in the search. 
-    if((int)count < n) 
+    bzero(vs, sizeof(struct vmstat));
+    
+    int spl=splhigh();
+    if(as != NULL)
     {
-        if((int)best_count < n)         
-	{
-	    //not enough pages to replace. Panic
-            splx(spl);
-            return 0; 
-	}
-	else
-        {
-            //ok, we have enough nonkernel pages to replace
-            for(i=best_index; i < (int)(best_index + best_count); i++) 
-            {
-                u_int32_t ppaddr = coremap[i].paddr;
-                //the page is valid
-                if( IS_VALID(ppaddr) ) 
-                {
-                    //find an empty chunk in the disk to swap out the existing page
-                    u_int32_t chunk = get_empty_chunk();
-                    //mark entry into swap_table
-                    splx(spl);
-                    //Now, swapout the page into the chunk of the disk
-                    swapout(chunk,ppaddr);
-		    total_asyncpage_write++;
-		    //update the swap area map to make the page frame free for allocation.
-		    //we are allocating below. So, there is a possibility of a race condition here. 
-                    remove_ppage(ppaddr);
-                }
-            }
-	    
- 	    //so, we have now replaced pages starting from best_index to make space for the demanded n pages.
-	    //we will now claim these pages below.
-            index = best_index;	
-        }	
+        vs->vs_proc = as->as_stats;
+        vs->vs_rss = as->as_rss;
     }
-        
-    //claim the hole we set up above
-    for(i=index ; i < (int)(index + n); i++) 
+    vs->vs_total = vm_totals;
+    vs->vs_frames_free = coremap_free;
+    vs->vs_frames_reclaimed = total_frames_reclaimed;
+    vs->vs_frames_migrated = total_frames_migrated;
+    vs->vs_frames_zeroed = zero_pool_count;
+    vs->vs_zeroed_hits = zero_pool_hits;
+    vs->vs_zeroed_misses = zero_pool_misses;
+    vs->vs_swap_used = swaparea_size - swaparea_free;
+    vs->vs_zpool_pages = zpool_pages;
+    vs->vs_zpool_bytes = zpool_bytes;
+    vs->vs_zpool_used = 0;
+    vs->vs_zpool_stores = zpool_stores;
+    vs->vs_zpool_rejects = zpool_rejects;
+    vs->vs_zpool_hits = zpool_hits;
+    vs->vs_zpool_misses = zpool_misses;
+    splx(spl);
+    
+    if(as != NULL)
+        vs->vs_rss_limit = rss_limit(as);
+    vs->vs_frames = coremap_size;
+    vs->vs_swap_chunks = swaparea_size;
+    vs->vs_zpool_size = zpool_slots * ZSLOT_SIZE;
+    for(i = 0; i < zpool_slots; i++)
+        if(bitmap_isset(zpool_map, i))
+            vs->vs_zpool_used += ZSLOT_SIZE;
+    for(i = 0; i < coremap_size; i++)
     {
-        add_ppage(PADDR_TO_KVADDR(coremap[i].paddr), coremap[i].paddr, pid, PAGE_DIRTY);
+        if(!bitmap_isset(core_memmap, i))
+            continue;
+        if(IS_KERNEL(coremap[i].paddr) || IS_BUSY(coremap[i].paddr))
+            vs->vs_frames_kernel++;
+        else
+            vs->vs_frames_user++;
     }
-    splx(spl);    
+}
+
+/*
+ * Print the system wide VM statistics, for the vmstat menu command.
+ */
+void vmstat_print(void)
+{
+    struct vmstat vs;
+    int i, limit;
+    u_int32_t lookups;
     
-    paddr = coremap[index].paddr;
-    //kprintf("VM_ALLOCN: 0x%x\n", paddr);
+    vmstat_get(NULL, &vs);
+    lookups = vs.vs_zpool_hits + vs.vs_zpool_misses;
     
-    return (paddr & PAGE_FRAME);
+    kprintf("frames: %u total, %u free, %u kernel, %u user, %u reclaimed, "
+            "%u migrated\n",
+            vs.vs_frames, vs.vs_frames_free, vs.vs_frames_kernel, 
+            vs.vs_frames_user, vs.vs_frames_reclaimed, vs.vs_frames_migrated);
+    kprintf("zeroed frames: %u ready, %u taken, %u zeroed on demand\n",
+            vs.vs_frames_zeroed, vs.vs_zeroed_hits, vs.vs_zeroed_misses);
+    kprintf("swap: %u of %u chunks used\n", vs.vs_swap_used, vs.vs_swap_chunks);
+    for(i = 0; i < nswapdevs; i++)
+        kprintf("  %s: %d of %d chunks used, priority %d, %u pages read, "
+                "%u written\n", swapdevs[i].sd_name, 
+                swapdevs[i].sd_size - swapdevs[i].sd_free, swapdevs[i].sd_size,
+                swapdevs[i].sd_prio, swapdevs[i].sd_reads, swapdevs[i].sd_writes);
+    //compression ratio and hit rate in tenths
+    kprintf("swap pool: %u pages in %u of %u bytes, ratio %u.%u, "
+            "%u hits, %u misses, hit rate %u.%u%%, %u writes avoided, "
+            "%u pages to disk\n",
+            vs.vs_zpool_pages, vs.vs_zpool_used, vs.vs_zpool_size,
+            vs.vs_zpool_bytes ? vs.vs_zpool_pages*PAGE_SIZE*10/vs.vs_zpool_bytes/10 : 0,
+            vs.vs_zpool_bytes ? vs.vs_zpool_pages*PAGE_SIZE*10/vs.vs_zpool_bytes%10 : 0,
+            vs.vs_zpool_hits, vs.vs_zpool_misses,
+            lookups ? vs.vs_zpool_hits*1000/lookups/10 : 0,
+            lookups ? vs.vs_zpool_hits*1000/lookups%10 : 0,
+            vs.vs_zpool_stores, vs.vs_zpool_rejects);
+    kprintf("faults: %u tlb, %u page\n", 
+            vs.vs_total.vc_tlb_faults, vs.vs_total.vc_page_faults);
+    kprintf("pages: %u swapped in, %u swapped out, %u zero filled, "
+            "%u read from files, %u copied on write\n",
+            vs.vs_total.vc_swapins, vs.vs_total.vc_swapouts, 
+            vs.vs_total.vc_zero_fills, vs.vs_total.vc_file_reads, 
+            vs.vs_total.vc_cow_copies);
+    kprintf("fault latency:");
+    for(i = 0, limit = 10; i < VMSTAT_LAT_BUCKETS-1; i++, limit *= 10)
+        kprintf(" <%dus: %u", limit, vs.vs_total.vc_fault_lat[i]);
+    kprintf(" more: %u\n", vs.vs_total.vc_fault_lat[VMSTAT_LAT_BUCKETS-1]);
 }
 
 #endif